@@ -28,6 +28,8 @@
 struct vrr_sock {
 	struct sock sk;
 	u32 rem_addr;
+	u8 tclass;	/* of the data we send */
+	u8 noaggr;	/* don't hold our data for aggregation */
 };
 
 static inline struct vrr_sock *vrr_sk(const struct sock *sk)
@@ -35,36 +37,28 @@ static inline struct vrr_sock *vrr_sk(const struct sock *sk)
         return (struct vrr_sock *)sk;
 };
 
-#define VRR_HASHSIZE	32
-#define VRR_HASHMASK	(VRR_HASHSIZE-1)
-
-static struct	{
-	struct hlist_head hlist[VRR_HASHSIZE];
-	spinlock_t lock;
-} vrr_socks;
-
-void __init vrr_sock_init(void)
+void vrr_sock_init(struct vrr_node *vrr)
 {
 	unsigned int i;
 
 	for (i = 0; i < VRR_HASHSIZE; i++)
-		INIT_HLIST_HEAD(vrr_socks.hlist + i);
-	spin_lock_init(&vrr_socks.lock);
+		INIT_HLIST_HEAD(vrr->sock_hlist + i);
+	spin_lock_init(&vrr->sock_lock);
 }
 
-static struct hlist_head *vrr_hash_list(u32 addr)
+static struct hlist_head *vrr_hash_list(struct vrr_node *vrr, u32 addr)
 {
-	return vrr_socks.hlist + (addr & VRR_HASHMASK);
+	return vrr->sock_hlist + (addr & VRR_HASHMASK);
 }
 
-struct sock *vrr_find_sock(u32 addr)
+struct sock *vrr_find_sock(struct vrr_node *vrr, u32 addr)
 {
 	struct hlist_node *node;
 	struct sock *sknode;
 	struct sock *ret = NULL;
-	struct hlist_head *head = vrr_hash_list(addr);
+	struct hlist_head *head = vrr_hash_list(vrr, addr);
 
-	spin_lock_bh(&vrr_socks.lock);
+	spin_lock_bh(&vrr->sock_lock);
 
 	sk_for_each(sknode, node, head) {
 		struct vrr_sock *vsk = vrr_sk(sknode);
@@ -76,7 +70,7 @@ struct sock *vrr_find_sock(u32 addr)
 		break;
 	}
 
-	spin_unlock_bh(&vrr_socks.lock);
+	spin_unlock_bh(&vrr->sock_lock);
 
 	if (ret)
 		VRR_DBG("Found socket for %x", addr);
@@ -86,24 +80,27 @@ struct sock *vrr_find_sock(u32 addr)
 
 void vrr_hash_sock(struct sock *sk)
 {
+	struct vrr_node *vrr = vrr_get_node(sock_net(sk));
 	u32 addr = vrr_sk(sk)->rem_addr;
-	struct hlist_head *head = vrr_hash_list(addr);
+	struct hlist_head *head = vrr_hash_list(vrr, addr);
 
 	VRR_DBG("Adding socket for %x", addr);
 
-	spin_lock_bh(&vrr_socks.lock);
+	spin_lock_bh(&vrr->sock_lock);
 	sk_add_node(sk, head);
-	spin_unlock_bh(&vrr_socks.lock);
+	spin_unlock_bh(&vrr->sock_lock);
 	sock_hold(sk);
 }
 
 void vrr_unhash_sock(struct sock *sk)
 {
+	struct vrr_node *vrr = vrr_get_node(sock_net(sk));
+
 	VRR_DBG("Deleting socket");
 
-	spin_lock_bh(&vrr_socks.lock);
+	spin_lock_bh(&vrr->sock_lock);
 	sk_del_node_init(sk);
-	spin_unlock_bh(&vrr_socks.lock);
+	spin_unlock_bh(&vrr->sock_lock);
 	sock_put(sk);
 }
 
@@ -195,7 +192,7 @@ restart:
 	skb = skb_peek(&sk->sk_receive_queue);
 
 	vh = vrr_hdr(skb);
-	sz = ntohs(vh->data_len);
+	sz = vrr_hdr_data_len(vh);
 	VRR_DBG("sz: %x", sz);
 
 	if (!sz) {
@@ -208,9 +205,9 @@ restart:
 		msg->msg_flags |= MSG_TRUNC;
 	}
 
-	if (unlikely(copy_to_user(msg->msg_iov->iov_base,
-				  skb->data + sizeof(struct vrr_header),
-				  sz))) {
+	/* Frames merged by GRO are not linear */
+	if (unlikely(skb_copy_datagram_iovec(skb, vrr_hdr_len(vh),
+					     msg->msg_iov, sz))) {
 		ret = -EFAULT;
 		goto out;
 	}
@@ -233,28 +230,32 @@ static int vrr_sendmsg(struct kiocb *iocb, struct socket *sock,
 	struct sk_buff *skb = NULL;
 	struct sockaddr_vrr *dest = (struct sockaddr_vrr *)msg->msg_name;
 	struct vrr_packet pkt;
-	u32 nh;
-	struct vrr_node *me = vrr_get_node();
+	u32 nh, path_id = 0;
+	struct vrr_node *me = vrr_get_node(sock_net(sock->sk));
 	size_t sent = 0;
 	int ret = -EINVAL;
 
 	if (unlikely(!dest))
 		return -EDESTADDRREQ;
 
+	/* Larger datagrams are fragmented on output */
+	if (len > VRR_DATA_MAX)
+		return -EMSGSIZE;
+
 	VRR_DBG("dest_addr: %x", dest->svrr_addr);
 
 	if (dest->svrr_addr != me->id) {
-		nh = rt_get_next(dest->svrr_addr);
+		nh = vrr_next_hop(me, dest->svrr_addr, me->id, &path_id);
 		VRR_DBG("nh: %x", nh);
 
 		if (!nh)
 			return -EHOSTUNREACH;
 
-		if (!pset_get_mac(nh, pkt.dest_mac))
+		if (!pset_get_mac(me, nh, pkt.dest_mac))
 			return -EHOSTUNREACH;
 	}
 
-	pkt.src = get_vrr_id();
+	pkt.src = get_vrr_id(me);
 	pkt.dst = dest->svrr_addr;
 	pkt.pkt_type = VRR_DATA;
 	pkt.data_len = len;
@@ -266,9 +267,11 @@ static int vrr_sendmsg(struct kiocb *iocb, struct socket *sock,
 	}
 
 	/* Build the vrr header */
-	ret = build_header(skb, &pkt);
+	ret = build_header(me, skb, &pkt);
 	if (ret)
 		goto out_err;
+	vrr_set_tclass(skb, vrr_sk(sock->sk)->tclass);
+	VRR_SKB_CB(skb)->noaggr = vrr_sk(sock->sk)->noaggr;
 
 	/* Copy data from userspace */
 	if (memcpy_fromiovec(skb_put(skb, len), msg->msg_iov, len)) {
@@ -278,10 +281,12 @@ static int vrr_sendmsg(struct kiocb *iocb, struct socket *sock,
 	}
 
 	sent += len;
+	vrr_set_label(me, skb, dest->svrr_addr, path_id);
 
 	/* Send packet */
 	VRR_DBG("Sending data to %x", dest->svrr_addr);
 	vrr_output(skb, me, VRR_DATA);
+	return sent;
 
  out_err:
 	kfree_skb(skb);
@@ -297,6 +302,62 @@ static int vrr_backlog_rcv(struct sock *sk, struct sk_buff *skb)
 	return err ? NET_RX_DROP : NET_RX_SUCCESS;
 }
 
+static int vrr_setsockopt(struct socket *sock, int level, int optname,
+			  char __user *optval, unsigned int optlen)
+{
+	int val;
+
+	if (level != SOL_VRR)
+		return -ENOPROTOOPT;
+	if (optlen < sizeof(int))
+		return -EINVAL;
+	if (get_user(val, (int __user *)optval))
+		return -EFAULT;
+
+	switch (optname) {
+	case VRR_TCLASS:
+		/* The control class is kept for VRR itself */
+		if (val < VRR_TC_BE || val >= VRR_TC_CTL)
+			return -EINVAL;
+		vrr_sk(sock->sk)->tclass = val;
+		return 0;
+	case VRR_NOAGGR:
+		vrr_sk(sock->sk)->noaggr = !!val;
+		return 0;
+	default:
+		return -ENOPROTOOPT;
+	}
+}
+
+static int vrr_getsockopt(struct socket *sock, int level, int optname,
+			  char __user *optval, int __user *optlen)
+{
+	int val, len;
+
+	if (level != SOL_VRR)
+		return -ENOPROTOOPT;
+	if (get_user(len, optlen))
+		return -EFAULT;
+	if (len < sizeof(int))
+		return -EINVAL;
+
+	switch (optname) {
+	case VRR_TCLASS:
+		val = vrr_sk(sock->sk)->tclass;
+		break;
+	case VRR_NOAGGR:
+		val = vrr_sk(sock->sk)->noaggr;
+		break;
+	default:
+		return -ENOPROTOOPT;
+	}
+
+	len = sizeof(int);
+	if (put_user(len, optlen) || copy_to_user(optval, &val, len))
+		return -EFAULT;
+	return 0;
+}
+
 static int vrr_release(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
@@ -322,6 +383,8 @@ static struct proto_ops vrr_proto_ops = {
 	.recvmsg = vrr_recvmsg,
 	.release = vrr_release,
 	.sendmsg = vrr_sendmsg,
+	.setsockopt = vrr_setsockopt,
+	.getsockopt = vrr_getsockopt,
 	.mmap = sock_no_mmap,
 	.socketpair = sock_no_socketpair,
 	.accept = sock_no_accept,
@@ -7,3 +7,13 @@ struct sockaddr_vrr {
 	unsigned int	svrr_addr;   /* VRR identifier */
 	char		svrr_zero[10]; /* Padding */
 };
+
+/* Socket options, level SOL_VRR */
+#define SOL_VRR 280
+#define VRR_TCLASS 1	/* int, traffic class of data sent */
+#define VRR_NOAGGR 2	/* int, send data frames on their own */
+
+/* Traffic classes */
+#define VRR_TC_BE 0
+#define VRR_TC_BULK 1
+#define VRR_TC_INTERACTIVE 2
@@ -6,9 +6,15 @@
 #include <linux/skbuff.h>
 #include <linux/socket.h>
 #include <linux/netdevice.h>
+#include <linux/pkt_sched.h>
 #include <linux/hrtimer.h>
+#include <linux/jhash.h>
 #include <linux/random.h>
 #include <linux/types.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 #define WARN_ATOMIC if (in_atomic()) printk(KERN_ERR "\n%s: WARNING!!!!! THIS FUNCTION IS EXECUTED IN ATOMIC CONTEXT!!!!!\n", __func__)
 
@@ -25,7 +31,25 @@
 #define VRR_SETUP   	0x3
 #define VRR_SETUP_FAIL  0x4
 #define VRR_TEARDOWN    0x5
-#define VRR_NPTYPES	6
+#define VRR_HELLO_DELTA 0x6
+#define VRR_REPAIR	0x7
+#define VRR_AGGR	0x8
+#define VRR_DATA_FRAG	0x9
+#define VRR_NPTYPES	10
+
+/* Lists a delta hello places a pset entry in */
+#define VRR_HELLO_LA	0
+#define VRR_HELLO_LNA	1
+#define VRR_HELLO_P	2
+#define VRR_HELLO_GONE	3
+
+/* Steps of a local repair, see vrr_repair_routes() */
+#define VRR_REPAIR_SPLICE	0	/* to the relay: carry the path */
+#define VRR_REPAIR_NOTIFY	1	/* to the far side: relay took over */
+#define VRR_REPAIR_FAIL		2	/* back to the initiator */
+#define VRR_REPAIR_ACK		3	/* far side to the relay: notified */
+#define VRR_REPAIR_DONE		4	/* relay to the initiator: both
+					 * sides use the relay now */
 
 #define VRR_INFO(fmt, arg...)	printk(KERN_INFO "VRR: " fmt "\n" , ## arg)
 #define VRR_ERR(fmt, arg...)	printk(KERN_ERR "%s: " fmt "\n" , __func__ , ## arg)
@@ -36,23 +60,43 @@
 #define VRR_SKB_RESERVE 80 
 #define VRR_VSET_SIZE	4
 #define VRR_PSET_SIZE	20
+#define VRR_LINK_HASH	64	/* slots of the index of linked nodes,
+				 * over twice VRR_PSET_SIZE */
 
 //Offsets for accessing data in the header
 #define VRR_VERS        0x0
 #define VRR_PKT_TYPE    0x2
 #define VRR_PROTO_TYPE  0x4
 #define VRR_TLEN        0x6
-#define VRR_FREE        0xA
+#define VRR_HOPS        0xA
 #define VRR_CSUM        0xC
 #define VRR_SRC         0x10
 #define VRR_DST         0x18
 
-#define VRR_HPKT_DELAY  	10000	/* milliseconds */
+#define VRR_HPKT_DELAY  	10000	/* milliseconds, slowest hello
+					 * interval once stable */
+#define VRR_HPKT_MIN_DELAY	500	/* milliseconds, hello interval
+					 * right after a change */
+#define VRR_HPKT_JITTER		25	/* +/- percent of the hello
+					 * interval */
 #define VRR_FAIL_TIMEOUT	4	/* multiple of delay to mark
                                          * failed nodes */
 #define VRR_ACTIVE_TIMEOUT	8	/* multiple of delay to activate
                                 	* this node without virtual
                                 	* neighbors */
+#define VRR_TX_FAIL_LIMIT	3	/* consecutive transmit failures
+					 * to mark a neighbor failed */
+#define VRR_BOOT_TIMEOUT	10000	/* milliseconds, longest bootstrap
+					 * phase after the node comes up */
+#define VRR_BOOT_STABLE		3	/* fast hello periods the pset must
+					 * stay unchanged before a
+					 * bootstrapping node activates */
+#define VRR_HELLO_FULL_MAX	3	/* multiple of delay between full
+					 * hellos, bounds both suppression
+					 * and chains of delta hellos */
+#define VRR_HELLO_DELTA_MAX	8	/* pset changes a delta hello
+					 * carries before a full hello is
+					 * cheaper */
 
 #define VRR_ID_LEN	4
 
@@ -63,7 +107,6 @@
 //Mac address
 #define MAC_ADDR_LEN 6
 typedef unsigned char mac_addr[MAC_ADDR_LEN];
-extern struct net *net;
 
 struct eth_header {
     mac_addr dest;
@@ -78,6 +121,10 @@ struct pset_state {
 	 * adding/removing to these arrays quite a bit, and we'll need
 	 * to deal with shifting / bounds issues. -tad */
 
+	// taken for writing by pset_state_update, so that
+	// pset_get_proxy can read l_active without the pset lock
+	seqlock_t lock;
+
 	// arrays holding pset ids
         u32 l_active[VRR_PSET_SIZE];
 	u32 l_not_active[VRR_PSET_SIZE];
@@ -102,8 +149,46 @@ struct pset_state {
         int lam_size;
         int lnam_size;
         int pm_size;  
+
+        // seq of the last hello sent, and the lists advertised by
+        // the last full hello that delta hellos are encoded against
+        u32 hello_seq;
+        u32 base_seq;
+        int base_size;
+        u32 base_id[3 * VRR_PSET_SIZE];
+        u8 base_list[3 * VRR_PSET_SIZE];
+
+        // linked nodes, active or not, with the weight and ETX of the
+        // link to them and the nodes they are linked to, so that the
+        // forwarding path can read them without the pset lock.
+        // link_slot is an open addressed index by node id holding
+        // the position in these arrays plus one, 0 if empty
+        int link_size;
+        u32 link_id[VRR_PSET_SIZE];
+        int link_weight[VRR_PSET_SIZE];
+        int link_etx[VRR_PSET_SIZE];
+        int link_nlinks[VRR_PSET_SIZE];
+        u32 link_links[VRR_PSET_SIZE][2 * VRR_PSET_SIZE];
+        u8 link_slot[VRR_LINK_HASH];
 };
 
+/* Position of node in the link arrays of pstate, or -1. Call with
+ * pstate->lock held or inside a read_seqbegin section. */
+static inline int pset_state_find(const struct pset_state *pstate, u32 node)
+{
+	unsigned int h = jhash_1word(node, 0);
+	int i, s;
+
+	for (i = 0; i < VRR_LINK_HASH; i++) {
+		s = pstate->link_slot[(h + i) & (VRR_LINK_HASH - 1)];
+		if (!s)
+			break;
+		if (s <= VRR_PSET_SIZE && pstate->link_id[s - 1] == node)
+			return s - 1;
+	}
+	return -1;
+}
+
 /* Structure describing a VRR socket address. */
 #define __SOCK_SIZE__	16      /* sizeof(struct sockaddr) */
 #define svrr_zero	__pad
@@ -117,20 +202,256 @@ struct sockaddr_vrr {
                               sizeof(unsigned long)];
 };
 
+#define VRR_MAX_IFACES	8	/* size of the interface enable list */
+
+/* An interface attached to a node, keyed by ifindex. Holds a
+ * reference on dev until the interface is detached. */
 struct vrr_interface_list {
+	struct net_device *dev;
+	int ifindex;
+	int up;		/* running with carrier */
 	char dev_name[IFNAMSIZ];
         struct list_head list;
 };
 
+#define VRR_CTL_BUDGET	16	/* control frames handled before the
+				 * worker yields */
+#define VRR_CTL_BACKLOG	256	/* control frames queued per CPU */
+#define VRR_CTL_NEIGH_RATE	20	/* setup frames per second and */
+#define VRR_CTL_NEIGH_BURST	40	/* burst admitted from a neighbor */
+#define VRR_CTL_TYPE_RATE	100	/* frames per second and burst */
+#define VRR_CTL_TYPE_BURST	200	/* admitted per setup type */
+
+#define VRR_SETUP_RETRY		1000	/* milliseconds before the first
+					 * setup_req retransmission */
+#define VRR_SETUP_RETRY_MAX	16000	/* milliseconds, backoff limit */
+#define VRR_SETUP_TRIES		5	/* retransmissions before giving
+					 * up on a virtual neighbor */
+
+#define VRR_REPAIR_GRACE	2000	/* milliseconds the higher id end of
+					 * a failed link keeps its routes
+					 * for the other end to repair */
+
+#define VRR_ETX_SCALE		256	/* ETX of a perfect link */
+#define VRR_ETX_WEIGHT		8	/* hello delivery ratio moves 1/8
+					 * of the way per hello */
+#define VRR_ETX_GAP_MAX		16	/* longer hello seq gaps are a
+					 * restart, not losses */
+#define VRR_ETX_POOR	(3 * VRR_ETX_SCALE)	/* not used as a proxy
+						 * if others are left */
+#define VRR_ETX_RELINK	(4 * VRR_ETX_SCALE)	/* a failed neighbor
+						 * relinks below this */
+#define VRR_ETX_FAIL	(8 * VRR_ETX_SCALE)	/* a neighbor is marked
+						 * failed above this */
+
+#define VRR_MULTIPATH_MAX	8	/* routes to a destination data
+					 * frames are spread over */
+#define VRR_FLOW_SIZE		256	/* flows remembered with their
+					 * next hop */
+#define VRR_FLOW_TIMEOUT	2000	/* milliseconds a flow keeps its
+					 * next hop after its last frame */
+#define VRR_LABEL_SIZE		256	/* buckets of the routing table
+					 * hashed by path id */
+#define VRR_LOAD_SCALE		256	/* load of a neighbor whose queue
+					 * is always busy */
+#define VRR_LOAD_WEIGHT		8	/* load moves 1/8 of the way per
+					 * frame sent */
+
+#define VRR_AGGR_SMALL		256	/* data frames up to this many
+					 * bytes are aggregated */
+#define VRR_AGGR_DELAY		2	/* milliseconds a small frame may
+					 * wait for others */
+#define VRR_AGGR_MAX(mtu)	((mtu) - sizeof(struct vrr_header))
+
+#define VRR_DATA_MAX		(0xffff - sizeof(struct vrr_frag_header))
+					/* bytes of data in one send, so a
+					 * coalesced fragment still fits */
+#define VRR_REASM_MAX		16	/* datagrams reassembled at once */
+#define VRR_REASM_TIMEOUT	2000	/* milliseconds for all fragments
+					 * of a datagram to arrive */
+
+#define VRR_TXQ_QUANTUM		1514	/* bytes a neighbor may send per
+					 * round robin turn */
+#define VRR_TXQ_DEPTH		64	/* data frames queued per neighbor */
+#define VRR_TXQ_CTL_DEPTH	128	/* control frames queued */
+#define VRR_TXQ_BUDGET		64	/* frames sent before the scheduler
+					 * yields */
+#define VRR_TXQ_BACKOFF		8	/* milliseconds at most between
+					 * polls of stopped queues */
+
+#define VRR_DEDUP_SIZE		64	/* setup frames remembered */
+#define VRR_DEDUP_TIMEOUT	500	/* milliseconds a setup frame is
+					 * remembered */
+
+/* A retransmitted setup_req carries the same (src, dst, proxy) as the
+ * first one, so it must come after the copy is forgotten */
+#if VRR_DEDUP_TIMEOUT >= VRR_SETUP_RETRY * (100 - VRR_HPKT_JITTER) / 100
+#error "VRR_DEDUP_TIMEOUT must be below the shortest setup retry delay"
+#endif
+
+/* A setup frame seen recently, see vrr_dedup_seen() */
+struct vrr_dedup_entry {
+	u32 src;
+	u32 dst;
+	u32 id;		/* proxy of a setup_req, path id of a setup */
+	u8 pkt_type;
+	unsigned long stamp;	/* jiffies, 0 if unused */
+};
+
+/* Token bucket refilled with rate tokens per second, up to burst */
+struct vrr_bucket {
+	unsigned long stamp;	/* jiffies */
+	int tokens;
+};
+
+static inline void vrr_bucket_init(struct vrr_bucket *b, int burst)
+{
+	b->stamp = jiffies;
+	b->tokens = burst;
+}
+
+/* Returns 1 and takes a token if one is left */
+static inline int vrr_bucket_take(struct vrr_bucket *b, int rate, int burst)
+{
+	unsigned long elapsed = jiffies - b->stamp;
+	int add;
+
+	if (elapsed >= (unsigned long)HZ * burst / rate) {
+		b->tokens = burst;
+		b->stamp = jiffies;
+	} else if ((add = elapsed * rate / HZ)) {
+		b->tokens = min(burst, b->tokens + add);
+		b->stamp += (unsigned long)add * HZ / rate;
+	}
+
+	if (b->tokens <= 0)
+		return 0;
+	b->tokens--;
+	return 1;
+}
+
+/* Per-node counters, shown in /sys/kernel/vrr/stats */
+enum {
+	VRR_STAT_CTL_QUEUED,	/* control frames handed to the worker */
+	VRR_STAT_CTL_DONE,	/* control frames handled */
+	VRR_STAT_CTL_BACKLOG,	/* dropped, worker backlog full */
+	VRR_STAT_CTL_BUDGET,	/* worker ran out of budget */
+	VRR_STAT_CTL_NEIGH,	/* throttled, neighbor over its rate */
+	VRR_STAT_CTL_TYPE,	/* throttled, setup type over its rate */
+	VRR_STAT_DEDUP_HIT,	/* duplicate setup frames dropped */
+	VRR_STAT_HOP_EXPIRED,	/* dropped, out of hops */
+	VRR_STAT_LOOP,		/* forwarded back where it came from */
+	VRR_STAT_SETUP_RETRY,	/* setup_req retransmitted */
+	VRR_STAT_SETUP_GIVEUP,	/* setup_req never answered */
+	VRR_STAT_REPAIR_SPLICE,	/* paths spliced around a failed hop */
+	VRR_STAT_REPAIR_FAIL,	/* repairs that fell back to teardown */
+	VRR_STAT_SHORTCUT,	/* flows sent to or via a neighbor of the
+				 * destination, bypassing the rt */
+	VRR_STAT_TXQ_DROP,	/* dropped, transmit queue full */
+	VRR_STAT_AGGR_SENT,	/* aggregate frames sent */
+	VRR_STAT_AGGR_FRAMES,	/* data frames held for aggregation */
+	VRR_STAT_FRAG_SENT,	/* fragments sent */
+	VRR_STAT_REASM_OK,	/* datagrams reassembled */
+	VRR_STAT_REASM_DROP,	/* partial datagrams given up */
+	VRR_STAT_LABEL_HIT,	/* forwarded by their label */
+	VRR_STAT_LABEL_MISS,	/* stale label, routing table searched */
+	VRR_NSTATS
+};
+
+#define VRR_INC_STAT(vrr, stat)	atomic_inc(&(vrr)->stats[stat])
+#define VRR_ADD_STAT(vrr, stat, n) atomic_add(n, &(vrr)->stats[stat])
+
+#define VRR_HASHSIZE	32
+#define VRR_HASHMASK	(VRR_HASHSIZE-1)
+
+/* Routing table, pset and vset; private to vrr_data.c */
+struct vrr_data;
+
+/* Pending pset updates, control frames and datagrams being
+ * reassembled; private to vrr_input.c */
+struct vrr_update_queue;
+struct vrr_ctl_queue;
+struct vrr_reasm;
+
+/* Per-neighbor transmit queues and frames waiting to be aggregated;
+ * private to vrr_output.c */
+struct vrr_txq;
+struct vrr_aggr;
+
+/* One VRR node per network namespace. Allocated by the pernet
+ * subsystem in vrr_mod.c and looked up with vrr_get_node(net). */
 struct vrr_node {
+	struct net *net;
 	u_int id; //128 bit identifier to match those of IP
 	int vset_size; 
 	int rtable_value; //the size of the virtual neighborhood
 	u8 version;
 	int active;
-        int timeout;
+        unsigned long timeout;	/* jiffies of the last packet heard */
 
+	// attached interfaces and the enable list, see vrr_dev.c
 	struct vrr_interface_list dev_list;
+	spinlock_t dev_lock;
+	unsigned int mtu;	/* smallest of the interfaces that are up */
+	char ifaces[VRR_MAX_IFACES][IFNAMSIZ];
+	int n_ifaces;
+
+	struct pset_state *pstate;
+	struct vrr_data *data;
+
+	// adaptive hello timer and the work it queues on vrr_wq
+	struct hrtimer hello_timer;
+	struct work_struct hello_work;
+	unsigned int hello_delay;	/* milliseconds */
+	int hello_changed;
+	int hello_stop;
+	unsigned long full_sent;	/* jiffies */
+
+	// bootstrap phase, see vrr_bootstrap()
+	int bootstrap;
+	unsigned long boot_start;	/* jiffies */
+	unsigned long pset_changed;	/* jiffies */
+	u32 boot_proxy;
+
+	// repairs or tears down routes through failed neighbors
+	struct work_struct fail_work;
+	struct list_head repair_held;
+	struct list_head repair_spliced;	/* waiting for DONE */
+	spinlock_t repair_lock;
+	int repair_stop;
+
+	// pset updates queued by vrr_rcv_hello, per-CPU and lockless
+	struct vrr_update_queue *pset_updates;
+	atomic_t pset_update_seq;
+	struct work_struct pset_updates_work;
+
+	// control frames, handled by a per-CPU worker on vrr_wq
+	struct vrr_ctl_queue *ctl;
+	struct vrr_bucket ctl_bucket[VRR_NPTYPES];
+	spinlock_t ctl_lock;
+
+	// setup_reqs we sent and wait to see answered
+	struct list_head setup_pending;
+	spinlock_t setup_lock;
+	int setup_stop;
+
+	// frames waiting to be sent, when txq scheduling is on
+	struct vrr_txq *txq;
+	struct vrr_aggr *aggr;
+
+	// fragmented datagrams, ids we sent and ones we reassemble
+	atomic_t frag_id;
+	struct vrr_reasm *reasm;
+
+	// setup frames seen recently
+	struct vrr_dedup_entry dedup[VRR_DEDUP_SIZE];
+	spinlock_t dedup_lock;
+
+	atomic_t stats[VRR_NSTATS];
+
+	// sockets hashed by remote VRR id
+	struct hlist_head sock_hlist[VRR_HASHSIZE];
+	spinlock_t sock_lock;
 };
 
 struct vrr_packet {
@@ -141,12 +462,35 @@ struct vrr_packet {
      	mac_addr dest_mac;  
 };
 
+/* Version 2 added the hop limit. Version 1 nodes send 0 there, and
+ * their frames are forwarded without a limit. */
+#define VRR_VERSION	2
+#define VRR_VERSION_COMPACT 3	/* data frames only, see
+				 * struct vrr_data_header */
+#define VRR_VERSION_LABEL 4	/* compact and labelled, see
+				 * struct vrr_label */
+#define VRR_HOP_LIMIT	32	/* hops a frame may take */
+#define VRR_HOP_MASK	0x3f	/* the top bits of hop_limit carry
+				 * the traffic class */
+#define VRR_TC_SHIFT	6
+
+/* Traffic classes. Applications may pick any but VRR_TC_CTL for their
+ * data with the VRR_TCLASS socket option. */
+#define VRR_TC_BE	0	/* best effort, the default */
+#define VRR_TC_BULK	1
+#define VRR_TC_INTERACTIVE 2
+#define VRR_TC_CTL	3	/* every frame but data */
+
+#define SOL_VRR		280
+#define VRR_TCLASS	1	/* int, traffic class of data sent */
+#define VRR_NOAGGR	2	/* int, send data frames on their own */
+
 struct vrr_header {
 	u8 vrr_version;
 	u8 pkt_type;
 	u16 protocol;
 	u16 data_len;
-        u8 free;
+        u8 hop_limit;
         u16 h_csum;
         u_int src_id;
         u_int dest_id;
@@ -159,6 +503,150 @@ static inline struct vrr_header *vrr_hdr(const struct sk_buff *skb)
         return (struct vrr_header *)skb_network_header(skb);
 }
 
+/* Compact header of VRR_DATA frames, version 3. It is laid out on the
+ * wire as it is here, unpadded, and leaves out what the full header
+ * repeats: the protocol, the unused checksum and the next hop MAC,
+ * which is the Ethernet destination. Its first two bytes match the
+ * full header so either can be told apart and dispatched on. Frames
+ * of both versions are read through the vrr_hdr_*() accessors. */
+struct vrr_data_header {
+	u8 vrr_version;
+	u8 pkt_type;
+	__be16 data_len;
+	u8 hop_limit;
+	__be32 src_id;
+	__be32 dest_id;
+} __attribute__((packed));
+
+/* Follows the compact header of a version 4 frame: the route the
+ * source picked for it. Relays follow the route by its path id in
+ * the label instead of searching the routing table. */
+struct vrr_label {
+	__be32 endpoint;
+	__be32 path_id;
+} __attribute__((packed));
+
+static inline int vrr_hdr_compact(const struct vrr_header *vh)
+{
+	return vh->vrr_version == VRR_VERSION_COMPACT ||
+		vh->vrr_version == VRR_VERSION_LABEL;
+}
+
+static inline const struct vrr_data_header *
+vrr_chdr(const struct vrr_header *vh)
+{
+	return (const struct vrr_data_header *)vh;
+}
+
+static inline unsigned int vrr_hdr_len(const struct vrr_header *vh)
+{
+	if (vh->vrr_version == VRR_VERSION_LABEL)
+		return sizeof(struct vrr_data_header) +
+			sizeof(struct vrr_label);
+	return vrr_hdr_compact(vh) ? sizeof(struct vrr_data_header) :
+		sizeof(struct vrr_header);
+}
+
+/* Path id of the label of a frame, 0 if it has none */
+static inline u32 vrr_hdr_label(const struct vrr_header *vh, u32 *endpoint)
+{
+	const struct vrr_label *l;
+
+	if (vh->vrr_version != VRR_VERSION_LABEL)
+		return 0;
+	l = (const struct vrr_label *)(vrr_chdr(vh) + 1);
+	*endpoint = ntohl(l->endpoint);
+	return ntohl(l->path_id);
+}
+
+static inline u16 vrr_hdr_data_len(const struct vrr_header *vh)
+{
+	return ntohs(vrr_hdr_compact(vh) ? vrr_chdr(vh)->data_len :
+		     vh->data_len);
+}
+
+static inline u32 vrr_hdr_src(const struct vrr_header *vh)
+{
+	return ntohl(vrr_hdr_compact(vh) ? vrr_chdr(vh)->src_id :
+		     vh->src_id);
+}
+
+static inline u32 vrr_hdr_dst(const struct vrr_header *vh)
+{
+	return ntohl(vrr_hdr_compact(vh) ? vrr_chdr(vh)->dest_id :
+		     vh->dest_id);
+}
+
+/* The hop limit and traffic class byte */
+static inline u8 vrr_hdr_hops(const struct vrr_header *vh)
+{
+	return vrr_hdr_compact(vh) ? vrr_chdr(vh)->hop_limit : vh->hop_limit;
+}
+
+static inline void vrr_hdr_set_hops(struct vrr_header *vh, u8 hops)
+{
+	if (vrr_hdr_compact(vh))
+		((struct vrr_data_header *)vh)->hop_limit = hops;
+	else
+		vh->hop_limit = hops;
+}
+
+/* Follows the header of a VRR_DATA_FRAG frame. Every fragment but the
+ * last carries as much data as fits in the link MTU. */
+struct vrr_frag_header {
+	__be32 id;		/* datagram, per source */
+	__be16 total;		/* bytes of data in the datagram */
+	__be16 offset;		/* of this fragment's data */
+	u8 index;
+	u8 count;		/* fragments, at most 64 */
+	u8 span;		/* fragments carried, more than one
+				 * once coalesced by GRO */
+	u8 reserved;
+};
+
+#define VRR_FRAG_MAX	64
+#define VRR_FRAG_CHUNK(mtu)	(unsigned int)((mtu) - \
+					       sizeof(struct vrr_header) - \
+					       sizeof(struct vrr_frag_header))
+
+/* Per-skb state of the output path, in skb->cb */
+struct vrr_skb_cb {
+	u8 noaggr;	/* not to be aggregated */
+	u8 dest_mac[ETH_ALEN];	/* next hop of a compact frame */
+};
+
+#define VRR_SKB_CB(skb)	((struct vrr_skb_cb *)(skb)->cb)
+
+/* Next hop of a frame on its way out, skb->data at its VRR header */
+static inline u8 *vrr_next_mac(struct sk_buff *skb)
+{
+	struct vrr_header *vh = (struct vrr_header *)skb->data;
+
+	return vrr_hdr_compact(vh) ? VRR_SKB_CB(skb)->dest_mac :
+		vh->dest_mac;
+}
+
+static inline u8 vrr_tclass(const struct vrr_header *vh)
+{
+	return vrr_hdr_hops(vh) >> VRR_TC_SHIFT;
+}
+
+/* skb->priority of a traffic class, which picks the band of the
+ * device qdisc */
+static inline u32 vrr_tc_prio(u8 tclass)
+{
+	switch (tclass) {
+	case VRR_TC_BULK:
+		return TC_PRIO_BULK;
+	case VRR_TC_INTERACTIVE:
+		return TC_PRIO_INTERACTIVE;
+	case VRR_TC_CTL:
+		return TC_PRIO_CONTROL;
+	default:
+		return TC_PRIO_BESTEFFORT;
+	}
+}
+
 static inline struct sk_buff *vrr_skb_alloc(unsigned int len, gfp_t how)
 {
 	struct sk_buff *skb = NULL;
@@ -169,20 +657,52 @@ static inline struct sk_buff *vrr_skb_alloc(unsigned int len, gfp_t how)
 	return skb;
 }
 
+/*
+ * Functions provided by vrr_mod.c
+ */
+
+extern struct workqueue_struct *vrr_wq;
+
+struct vrr_node *vrr_get_node(struct net *net);
+void vrr_hello_fast(struct vrr_node *vrr);
+
 /*
  * Functions provided by vrr_input.c
  */
 
 int vrr_rcv(struct sk_buff *skb, struct net_device *dev,
             struct packet_type *pt, struct net_device *orig_dev);
+struct sk_buff **vrr_gro_receive(struct sk_buff **head, struct sk_buff *skb);
+int vrr_gro_complete(struct sk_buff *skb);
 
+// next hop of a data frame, neighbors first, then the rt; path_id
+// gets the route taken, 0 if none
+u32 vrr_next_hop(struct vrr_node *vrr, u32 dest, u32 src, u32 *path_id);
 // forward packet to id closest to dest in rt
-int vrr_forward(struct sk_buff *skb, const struct vrr_header *vh);
-int vrr_forward_setup_req(struct sk_buff *skb, 
+int vrr_forward(struct vrr_node *vrr, struct sk_buff *skb,
+		const struct vrr_header *vh);
+int vrr_forward_setup_req(struct vrr_node *vrr, struct sk_buff *skb, 
 			  const struct vrr_header *vh,
 			  u_int next_hop);
 
-struct sock *vrr_find_sock(u32 addr);
+/*
+ * Functions provided by vrr_dev.c
+ */
+
+int vrr_dev_init(void);
+void vrr_dev_exit(void);
+void vrr_dev_node_init(struct vrr_node *vrr);
+void vrr_dev_node_exit(struct vrr_node *vrr);
+int vrr_dev_set_enabled(struct vrr_node *vrr, const char *names);
+ssize_t vrr_dev_show_enabled(struct vrr_node *vrr, char *buf);
+ssize_t vrr_dev_show_attached(struct vrr_node *vrr, char *buf);
+
+/*
+ * Functions provided by af_vrr.c
+ */
+
+void vrr_sock_init(struct vrr_node *vrr);
+struct sock *vrr_find_sock(struct vrr_node *vrr, u32 addr);
 
 /*
  * Functions provided by vrr_core.c
@@ -190,27 +710,51 @@ struct sock *vrr_find_sock(u32 addr);
   
 // Vrr node functionality
 int get_pkt_type(struct sk_buff *skb);
-int set_vrr_id(u_int vrr_id); //id is a random unsigned integer
-unsigned int get_vrr_id(void);
-int vrr_node_init(void);
-struct vrr_node *vrr_get_node(void);
-void reset_active_timeout(void);
+int set_vrr_id(struct vrr_node *vrr, u_int vrr_id); //id is a random unsigned integer
+unsigned int get_vrr_id(struct vrr_node *vrr);
+int vrr_node_init(struct vrr_node *vrr);
+void vrr_node_exit(struct vrr_node *vrr);
+void reset_active_timeout(struct vrr_node *vrr);
+void vrr_set_active(struct vrr_node *vrr);
+void vrr_bootstrap(struct vrr_node *vrr);
 
 // Vrr packet handling
-int send_hpkt(void);
-int send_setup_req(u_int src, u_int dest, u_int proxy);
-int send_setup(u32 src, u32 dest, u32 path_id, u32 proxy, u32 vset_size,
-               u32 *vset, u32 to);
-int send_setup_fail(u32 src, u32 dest, u32 proxy, u32 vset_size,
-		u32 *vset, u32 to);
-int send_teardown(u32 path_id, u32 endpoint, u32 *vset, 
+int send_hpkt(struct vrr_node *vrr);
+void vrr_send_hello(struct vrr_node *vrr, int changed);
+int send_setup_req(struct vrr_node *vrr, u_int src, u_int dest, u_int proxy);
+int vrr_request_setup(struct vrr_node *vrr, u32 dest, u32 proxy);
+void vrr_setup_done(struct vrr_node *vrr, u32 node);
+void vrr_setup_exit(struct vrr_node *vrr);
+int send_setup(struct vrr_node *vrr, u32 src, u32 dest, u32 path_id,
+	       u32 proxy, u32 vset_size, u32 *vset, u32 to);
+int send_setup_fail(struct vrr_node *vrr, u32 src, u32 dest, u32 proxy,
+		u32 vset_size, u32 *vset, u32 to);
+int send_teardown(struct vrr_node *vrr, u32 path_id, u32 endpoint, u32 *vset, 
 		u32 vset_size, u32 to);
-int tear_down_path(u32 path_id, u32 endpoint, u32 sender);
-int build_header(struct sk_buff *skb, struct vrr_packet *vpkt);
+int tear_down_path(struct vrr_node *vrr, u32 path_id, u32 endpoint,
+		u32 sender);
+int send_repair(struct vrr_node *vrr, u32 step, u32 ea, u32 eb, u32 path_id,
+		u32 na, u32 nb, u32 to);
+void vrr_repair_failed(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+		       u32 relay);
+void vrr_repair_done(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+		     u32 relay);
+void vrr_repair_exit(struct vrr_node *vrr);
+int build_header(struct vrr_node *vrr, struct sk_buff *skb,
+		 struct vrr_packet *vpkt);
+void vrr_set_tclass(struct sk_buff *skb, u8 tclass);
+void vrr_set_label(struct vrr_node *vrr, struct sk_buff *skb, u32 endpoint,
+		   u32 path_id);
 int vrr_output(struct sk_buff *skb, struct vrr_node *node, int type);
-int vrr_add(u32 src, u_int vset_size, u_int *vset);
-
-void __init vrr_init_rcv(void);
+int vrr_init_txq(struct vrr_node *vrr);
+void vrr_exit_txq(struct vrr_node *vrr);
+int vrr_init_aggr(struct vrr_node *vrr);
+void vrr_exit_aggr(struct vrr_node *vrr);
+int vrr_add(struct vrr_node *vrr, u32 src, u_int vset_size, u_int *vset);
+
+int vrr_init_rcv(struct vrr_node *vrr);
+void vrr_exit_rcv(struct vrr_node *vrr);
+int vrr_ctl_backlog(struct vrr_node *vrr);
 /* Various utilities */
 u32 vrr_new_path_id(void);
 
@@ -218,32 +762,36 @@ u32 vrr_new_path_id(void);
  * Functions to handle pset state
  */
 
-int pset_state_init(void);
+int pset_state_init(struct vrr_node *vrr);
 
 //return a pointer any of the pset state arrays
-u32 *get_pset_active(void);
-u32 *get_pset_not_active(void);
-u32 *get_pset_pending(void);
+u32 *get_pset_active(struct vrr_node *vrr);
+u32 *get_pset_not_active(struct vrr_node *vrr);
+u32 *get_pset_pending(struct vrr_node *vrr);
 
 //return the number of bytes in the pset state arrays
-int get_pset_active_size(void);
-int get_pset_not_active_size(void);
-int get_pset_pending_size(void);
+int get_pset_active_size(struct vrr_node *vrr);
+int get_pset_not_active_size(struct vrr_node *vrr);
+int get_pset_pending_size(struct vrr_node *vrr);
 
 //return a pointer to any of the the pset mac arrays
-mac_addr *get_pset_active_mac(void);
-mac_addr *get_pset_not_active_mac(void);
-mac_addr *get_pset_pending_mac(void);
+mac_addr *get_pset_active_mac(struct vrr_node *vrr);
+mac_addr *get_pset_not_active_mac(struct vrr_node *vrr);
+mac_addr *get_pset_pending_mac(struct vrr_node *vrr);
 
 //return the number of bytes in the pset mac arrays
-int get_pset_active_mac_size(void);
-int get_pset_not_active_mac_size(void);
-int get_pset_pending_mac_size(void);
-
-void pset_state_update(void);
-
-void detect_failures(void);
-void active_timeout(void);
+int get_pset_active_mac_size(struct vrr_node *vrr);
+int get_pset_not_active_mac_size(struct vrr_node *vrr);
+int get_pset_pending_mac_size(struct vrr_node *vrr);
+
+struct pset_list;
+void pset_state_update(struct vrr_node *vrr);
+void pset_state_link(struct vrr_node *vrr, struct pset_list *p);
+
+void detect_failures(struct vrr_node *vrr);
+void vrr_link_failed(struct vrr_node *vrr, int ifindex);
+void vrr_schedule_repair(struct vrr_node *vrr);
+void active_timeout(struct vrr_node *vrr);
 
 
 #endif	/* _VRR_H */
@@ -3,52 +3,66 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/skbuff.h>
 #include <linux/errno.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
 #include "vrr.h"
 #include "vrr_data.h"
 
-struct vrr_node *vrr;
-struct pset_state *pstate;
+/* Send data frames with the compact header, see
+ * struct vrr_data_header */
+static int compact = 1;
+module_param(compact, int, 0644);
+MODULE_PARM_DESC(compact, "Send data frames with the compact header (0/1)");
 
-int vrr_node_init()
+/* Label data frames with their route, see vrr_set_label() */
+static int label;
+module_param(label, int, 0644);
+MODULE_PARM_DESC(label, "Label data frames with their route (0/1)");
+
+static void vrr_fail_handler(struct work_struct *work);
+
+int vrr_node_init(struct vrr_node *vrr)
 {
 	/*initialize all node
-	 * members.
+	 * members. The node itself is allocated
+	 * by the pernet subsystem.
 	 */
-	int rand_id;
-        struct net_device *d;
-        struct vrr_interface_list *tmp;
-
-	vrr = kmalloc(sizeof(struct vrr_node), GFP_KERNEL);
-  	if(!vrr){
-	    printk(KERN_CRIT "Could not allocate vrr node");
-	    return -1;
-	}
+	int rand_id, i;
 
         rand_id = 0;
 
-	vrr = (struct vrr_node *)kmalloc(sizeof(struct vrr_node), GFP_KERNEL);
         vrr->vset_size = 4;
         vrr->rtable_value = 0;
-        vrr->version = 0x1;
+        vrr->version = VRR_VERSION;
 	vrr->active = 0;
-        vrr->timeout = 0;
-
-	// initialize the interface list
-	INIT_LIST_HEAD(&vrr->dev_list.list);
-	for_each_netdev(&init_net, d) {
-		if (d->name) {
-			if (strcmp(d->name, "eth0") &&
-			    strcmp(d->name, "lo")) {
-				tmp = (struct vrr_interface_list *)
-					kmalloc(sizeof(struct vrr_interface_list), GFP_KERNEL);
-				sscanf(d->name, "%s", tmp->dev_name);
-				list_add(&(tmp->list), &(vrr->dev_list.list));
-                        }
-              	}
-	}
+        vrr->timeout = jiffies;
+
+        vrr->bootstrap = 1;
+        vrr->boot_start = vrr->pset_changed = jiffies;
+        vrr->boot_proxy = 0;
+
+        for (i = 0; i < VRR_NSTATS; i++)
+                atomic_set(&vrr->stats[i], 0);
+
+        INIT_LIST_HEAD(&vrr->setup_pending);
+        spin_lock_init(&vrr->setup_lock);
+        vrr->setup_stop = 0;
+
+        atomic_set(&vrr->frag_id, 0);
+
+        INIT_LIST_HEAD(&vrr->repair_held);
+        INIT_LIST_HEAD(&vrr->repair_spliced);
+        spin_lock_init(&vrr->repair_lock);
+        vrr->repair_stop = 0;
+
+	// initialize the interface list, interfaces are attached
+	// by the netdevice notifier as they show up
+	vrr_dev_node_init(vrr);
+
+	INIT_WORK(&vrr->fail_work, vrr_fail_handler);
 
         //generate random id
         get_random_bytes(&vrr->id, VRR_ID_LEN);
@@ -56,11 +70,23 @@ int vrr_node_init()
 	return 0;
 }
 
+/* release the interface list and pset state of a node
+ */
+void vrr_node_exit(struct vrr_node *vrr)
+{
+	vrr_dev_node_exit(vrr);
+
+	kfree(vrr->pstate);
+	vrr->pstate = NULL;
+}
+
 /* allocate the structure and set the size fields
  * for the states
  */
-int pset_state_init()
+int pset_state_init(struct vrr_node *vrr)
 {
+	struct pset_state *pstate;
+
 	pstate = kmalloc(sizeof(struct pset_state), GFP_KERNEL);
         if(!pstate)
 	    return -ENOMEM;
@@ -73,18 +99,70 @@ int pset_state_init()
         pstate->lnam_size = 0;
 	pstate->pm_size = 0;
 
+        pstate->hello_seq = 0;
+        pstate->base_seq = 0;
+        pstate->base_size = 0;
+
+        pstate->link_size = 0;
+        memset(pstate->link_slot, 0, sizeof(pstate->link_slot));
+
+        seqlock_init(&pstate->lock);
+
+	vrr->pstate = pstate;
 	return 0;
 }
 
-void pset_state_update()
+/* Copy what the forwarding path reads of linked node p into slot i of
+ * the link arrays. Called with the pset lock and pstate->lock held. */
+static void pset_state_copy_link(struct pset_state *pstate, int i,
+                                 pset_list_t *p)
 {
-        pset_list_t *p;
-        struct list_head *pos;
-        int i, la_i = 0, lna_i = 0, p_i = 0;
+        int n = min(p->n_links, 2 * VRR_PSET_SIZE);
+
+        pstate->link_id[i] = p->node;
+        pstate->link_weight[i] = pset_weight(p);
+        pstate->link_etx[i] = p->etx;
+        pstate->link_nlinks[i] = n;
+        memcpy(pstate->link_links[i], p->links, n * sizeof(u32));
+}
 
+/* Publish a change to the link to p made under the pset lock, without
+ * rebuilding the whole state. Nodes that aren't in the link arrays
+ * wait for the next pset_state_update. */
+void pset_state_link(struct vrr_node *vrr, struct pset_list *p)
+{
+        struct pset_state *pstate = vrr->pstate;
+        unsigned long flags;
+        int i;
+
+        write_seqlock_irqsave(&pstate->lock, flags);
+        i = pset_state_find(pstate, p->node);
+        if (i >= 0)
+                pset_state_copy_link(pstate, i, p);
+        write_sequnlock_irqrestore(&pstate->lock, flags);
+}
 
-        list_for_each(pos, pset_head()) {
+void pset_state_update(struct vrr_node *vrr)
+{
+        struct pset_state *pstate = vrr->pstate;
+        pset_list_t *p;
+        struct list_head *pos;
+        unsigned long flags, pflags;
+        int i, la_i = 0, lna_i = 0, p_i = 0, l_i = 0;
+        unsigned int h;
+
+        pset_lock(vrr, &pflags);
+        write_seqlock_irqsave(&pstate->lock, flags);
+        memset(pstate->link_slot, 0, sizeof(pstate->link_slot));
+        list_for_each(pos, pset_head(vrr)) {
                 p = list_entry(pos, pset_list_t, list);
+                if (p->status == PSET_LINKED && l_i < VRR_PSET_SIZE) {
+                        pset_state_copy_link(pstate, l_i, p);
+                        h = jhash_1word(p->node, 0);
+                        while (pstate->link_slot[h & (VRR_LINK_HASH - 1)])
+                                h++;
+                        pstate->link_slot[h & (VRR_LINK_HASH - 1)] = ++l_i;
+                }
                 if (p->status == PSET_LINKED) {
                         if (p->active) {
                                 pstate->l_active[la_i] = p->node;
@@ -108,43 +186,568 @@ void pset_state_update()
         pstate->la_size = pstate->lam_size = la_i;
         pstate->lna_size = pstate->lnam_size = lna_i;
         pstate->p_size = pstate->pm_size = p_i;
+        pstate->link_size = l_i;
+        write_sequnlock_irqrestore(&pstate->lock, flags);
+        pset_unlock(vrr, pflags);
+
+        /* advertise the new pset quickly */
+        vrr->pset_changed = jiffies;
+        vrr_hello_fast(vrr);
 }
 
-void detect_failures() {
-        pset_list_t *tmp;
-        struct list_head *pos, *q;
-        u_int count, status;
+void detect_failures(struct vrr_node *vrr) {
+        if (pset_expire(vrr)) {
+                pset_state_update(vrr);
+                vrr_schedule_repair(vrr);
+        }
+}
 
-        list_for_each_safe(pos, q, pset_head()) {
-                tmp = list_entry(pos, pset_list_t, list);
-                status = tmp->status;
-                count = pset_inc_fail_count(tmp);
-                if (count >= VRR_FAIL_TIMEOUT && status != PSET_FAILED) {
-                        VRR_DBG("Marking failed node: %x", tmp->node);
-                        tmp->status = PSET_FAILED;
-                        pset_state_update();
-                }
-                if (count >= 2 * VRR_FAIL_TIMEOUT) {
-                        VRR_DBG("Deleting failed node: %x", tmp->node);
-                        list_del(pos);
-                        kfree(tmp);
+/* route no longer goes through node. Tear it down toward its other
+ * next hop and set up the virtual neighbor we lost, if any. */
+static void vrr_route_broken(struct vrr_node *vrr, rt_entry *route, u32 node)
+{
+        u32 next, lost, proxy;
+
+        VRR_DBG("Path %x (%x, %x) broken at %x", route->path_id,
+                route->ea, route->eb, node);
+
+        next = (route->na == node) ? route->nb : route->na;
+        if (next && next != vrr->id && pset_contains(vrr, next))
+                send_teardown(vrr, route->path_id, route->ea,
+                              NULL, 0, next);
+
+        lost = 0;
+        if (route->ea == vrr->id)
+                lost = route->eb;
+        else if (route->eb == vrr->id)
+                lost = route->ea;
+
+        if (lost && vset_remove(vrr, lost) &&
+            pset_get_proxy(vrr, lost, 0, &proxy))
+                vrr_request_setup(vrr, lost, proxy);
+}
+
+/* Tear down every vset-path through a failed physical neighbor. The
+ * next hop on the far side of each path gets a teardown, and virtual
+ * neighbors we reached through the failed node are set up again
+ * through another proxy.
+ */
+static void vrr_teardown_routes(struct vrr_node *vrr, u32 node)
+{
+        LIST_HEAD(routes);
+        rt_entry *route, *tmp;
+
+        rt_remove_nexts(vrr, node, &routes);
+
+        list_for_each_entry_safe(route, tmp, &routes, list) {
+                vrr_route_broken(vrr, route, node);
+                list_del(&route->list);
+                kfree(route);
+        }
+}
+
+/* A splice we started is only trusted once the relay reports, with
+ * VRR_REPAIR_DONE, that the far side switched to it too. Without that
+ * within VRR_REPAIR_GRACE the path is torn down on both of our sides.
+ * Only the expiry work and vrr_repair_exit free an entry; an answer
+ * just marks it done. */
+struct vrr_repair_splice {
+        struct list_head list;
+        struct delayed_work work;
+        struct vrr_node *vrr;
+        u32 ea, eb, path_id, relay;
+        int done;
+};
+
+static void vrr_splice_expire(struct work_struct *work)
+{
+        struct vrr_repair_splice *sp = container_of(work,
+                                                    struct vrr_repair_splice,
+                                                    work.work);
+        struct vrr_node *vrr = sp->vrr;
+        unsigned long flags;
+        int done;
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        if (vrr->repair_stop) {
+                spin_unlock_irqrestore(&vrr->repair_lock, flags);
+                return;
+        }
+        list_del(&sp->list);
+        done = sp->done;
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+
+        if (!done) {
+                VRR_DBG("Splice of path %x through %x not confirmed",
+                        sp->path_id, sp->relay);
+                send_teardown(vrr, sp->path_id, sp->ea, NULL, 0, sp->relay);
+                vrr_repair_failed(vrr, sp->ea, sp->eb, sp->path_id,
+                                  sp->relay);
+        }
+        kfree(sp);
+}
+
+static void vrr_splice_wait(struct vrr_node *vrr, rt_entry *route, u32 relay)
+{
+        struct vrr_repair_splice *sp;
+        unsigned long flags;
+
+        sp = kmalloc(sizeof(struct vrr_repair_splice), GFP_ATOMIC);
+        if (!sp)
+                return;
+        INIT_DELAYED_WORK(&sp->work, vrr_splice_expire);
+        sp->vrr = vrr;
+        sp->ea = route->ea;
+        sp->eb = route->eb;
+        sp->path_id = route->path_id;
+        sp->relay = relay;
+        sp->done = 0;
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        if (vrr->repair_stop) {
+                spin_unlock_irqrestore(&vrr->repair_lock, flags);
+                kfree(sp);
+                return;
+        }
+        list_add(&sp->list, &vrr->repair_spliced);
+        queue_delayed_work(vrr_wq, &sp->work,
+                           msecs_to_jiffies(VRR_REPAIR_GRACE));
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+}
+
+/* Mark the splice of <ea, eb, path_id> through relay as answered.
+ * Returns 1 if we were waiting for it. */
+static int vrr_splice_answered(struct vrr_node *vrr, u32 ea, u32 eb,
+                               u32 path_id, u32 relay)
+{
+        struct vrr_repair_splice *sp;
+        unsigned long flags;
+        int found = 0;
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        list_for_each_entry(sp, &vrr->repair_spliced, list) {
+                if (!sp->done && sp->ea == ea && sp->eb == eb &&
+                    sp->path_id == path_id && sp->relay == relay) {
+                        sp->done = 1;
+                        found = 1;
+                        break;
                 }
         }
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+
+        return found;
+}
+
+/* The relay reports that both sides now use it */
+void vrr_repair_done(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+                     u32 relay)
+{
+        if (vrr_splice_answered(vrr, ea, eb, path_id, relay))
+                VRR_DBG("Splice of path %x through %x confirmed",
+                        path_id, relay);
+}
+
+/* Splice route around the failed hop node through a linked neighbor
+ * that is linked to node itself. The relay takes the path over and
+ * tells node, see vrr_rcv_repair(). Returns 1 if the route now goes
+ * through the relay. */
+static int vrr_splice_route(struct vrr_node *vrr, rt_entry *route, u32 node)
+{
+        u32 other = (route->na == node) ? route->nb : route->na;
+        u32 relay, na, nb;
+
+        if (!pset_find_relay(vrr, node, other, &relay))
+                return 0;
+
+        /* The relay's next hops, we stay on the side of other */
+        na = (route->na == node) ? node : vrr->id;
+        nb = (route->na == node) ? vrr->id : node;
+
+        if (send_repair(vrr, VRR_REPAIR_SPLICE, route->ea, route->eb,
+                        route->path_id, na, nb, relay))
+                return 0;
+
+        if (!rt_add_route(vrr, route->ea, route->eb,
+                          (route->na == node) ? relay : route->na,
+                          (route->nb == node) ? relay : route->nb,
+                          route->path_id))
+                return 0;
+
+        vrr_splice_wait(vrr, route, relay);
+
+        VRR_DBG("Path %x (%x, %x) spliced around %x through %x",
+                route->path_id, route->ea, route->eb, node, relay);
+        VRR_INC_STAT(vrr, VRR_STAT_REPAIR_SPLICE);
+        return 1;
+}
+
+/* Both ends of a failed link see it fail. The lower id end splices
+ * the paths through it around the link, the higher id end holds them
+ * for VRR_REPAIR_GRACE and then tears down whatever was not taken
+ * over by a relay in the meantime. */
+struct vrr_repair_hold {
+        struct list_head list;
+        struct delayed_work work;
+        struct vrr_node *vrr;
+        u32 node;
+};
+
+static void vrr_repair_expire(struct work_struct *work)
+{
+        struct vrr_repair_hold *h = container_of(work,
+                                                 struct vrr_repair_hold,
+                                                 work.work);
+        struct vrr_node *vrr = h->vrr;
+        unsigned long flags;
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        if (vrr->repair_stop) {
+                spin_unlock_irqrestore(&vrr->repair_lock, flags);
+                return;
+        }
+        list_del(&h->list);
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+
+        /* The link may have come back while we waited */
+        if (pset_get_status(vrr, h->node) != PSET_LINKED)
+                vrr_teardown_routes(vrr, h->node);
+        kfree(h);
+}
+
+static void vrr_repair_hold(struct vrr_node *vrr, u32 node)
+{
+        struct vrr_repair_hold *h;
+        unsigned long flags;
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        list_for_each_entry(h, &vrr->repair_held, list)
+                if (h->node == node)
+                        break;
+
+        if (&h->list != &vrr->repair_held || vrr->repair_stop) {
+                spin_unlock_irqrestore(&vrr->repair_lock, flags);
+                return;
+        }
+
+        h = kmalloc(sizeof(struct vrr_repair_hold), GFP_ATOMIC);
+        if (h) {
+                INIT_DELAYED_WORK(&h->work, vrr_repair_expire);
+                h->vrr = vrr;
+                h->node = node;
+                list_add(&h->list, &vrr->repair_held);
+                queue_delayed_work(vrr_wq, &h->work,
+                                   msecs_to_jiffies(VRR_REPAIR_GRACE));
+        }
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+
+        if (!h)
+                vrr_teardown_routes(vrr, node);
+}
+
+static void vrr_repair_routes(struct vrr_node *vrr, u32 node)
+{
+        LIST_HEAD(routes);
+        rt_entry *route, *tmp;
+
+        if (vrr->id > node) {
+                vrr_repair_hold(vrr, node);
+                return;
+        }
+
+        rt_remove_nexts(vrr, node, &routes);
+
+        list_for_each_entry_safe(route, tmp, &routes, list) {
+                if (!vrr_splice_route(vrr, route, node))
+                        vrr_route_broken(vrr, route, node);
+                list_del(&route->list);
+                kfree(route);
+        }
+}
+
+/* The relay of a splice we started could not take the path over.
+ * Fall back to tearing it down. */
+void vrr_repair_failed(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+                       u32 relay)
+{
+        rt_entry *route;
+
+        vrr_splice_answered(vrr, ea, eb, path_id, relay);
+
+        route = rt_remove_path(vrr, ea, eb, path_id);
+
+        if (!route)
+                return;
+
+        VRR_INC_STAT(vrr, VRR_STAT_REPAIR_FAIL);
+        vrr_route_broken(vrr, route, relay);
+        kfree(route);
+}
+
+void vrr_repair_exit(struct vrr_node *vrr)
+{
+        struct vrr_repair_hold *h, *q;
+        struct vrr_repair_splice *sp, *sq;
+        unsigned long flags;
+        LIST_HEAD(held);
+        LIST_HEAD(spliced);
+
+        spin_lock_irqsave(&vrr->repair_lock, flags);
+        vrr->repair_stop = 1;
+        list_splice_init(&vrr->repair_held, &held);
+        list_splice_init(&vrr->repair_spliced, &spliced);
+        spin_unlock_irqrestore(&vrr->repair_lock, flags);
+
+        list_for_each_entry_safe(h, q, &held, list) {
+                cancel_delayed_work_sync(&h->work);
+                list_del(&h->list);
+                kfree(h);
+        }
+
+        list_for_each_entry_safe(sp, sq, &spliced, list) {
+                cancel_delayed_work_sync(&sp->work);
+                list_del(&sp->list);
+                kfree(sp);
+        }
+}
+
+static void vrr_fail_handler(struct work_struct *work)
+{
+        struct vrr_node *vrr = container_of(work, struct vrr_node,
+                                            fail_work);
+        u32 failed[VRR_PSET_SIZE];
+        int i, n, updated = 0;
+
+        do {
+                n = pset_take_failed(vrr, failed, VRR_PSET_SIZE);
+                if (n && !updated++)
+                        pset_state_update(vrr);
+                for (i = 0; i < n; i++)
+                        vrr_repair_routes(vrr, failed[i]);
+        } while (n == VRR_PSET_SIZE);
+}
+
+/* Neighbors that were just marked failed get their routes repaired
+ * from process context, away from the caller's locks. */
+void vrr_schedule_repair(struct vrr_node *vrr)
+{
+        queue_work(vrr_wq, &vrr->fail_work);
+}
+
+/* Carrier loss or an interface going away takes down every
+ * neighbor heard on it at once, instead of waiting for
+ * detect_failures to miss VRR_FAIL_TIMEOUT hellos. */
+void vrr_link_failed(struct vrr_node *vrr, int ifindex)
+{
+        if (pset_fail_ifindex(vrr, ifindex))
+                vrr_schedule_repair(vrr);
+}
+
+/* The hello interval varies, so the timeout is measured in
+ * VRR_HPKT_DELAY periods of wall time rather than in ticks. */
+void active_timeout(struct vrr_node *vrr) {
+        unsigned long expires;
+
+        if (vrr->active)
+                return;
+        expires = vrr->timeout +
+                msecs_to_jiffies(VRR_ACTIVE_TIMEOUT * VRR_HPKT_DELAY);
+        if (time_after_eq(jiffies, expires))
+                vrr_set_active(vrr);
+}
+
+void reset_active_timeout(struct vrr_node *vrr) {
+	vrr->timeout = jiffies;
+}
+
+/* A node that just came up hellos at the fast rate and asks the
+ * first active linked neighbor to set it up. It activates on its
+ * own once it has linked neighbors and its pset has not changed for
+ * VRR_BOOT_STABLE hello periods, instead of waiting out
+ * VRR_ACTIVE_TIMEOUT. Bootstrap ends once the node is active or
+ * after VRR_BOOT_TIMEOUT. */
+void vrr_bootstrap(struct vrr_node *vrr) {
+        struct pset_state *pstate = vrr->pstate;
+        unsigned long stable;
+
+        if (!vrr->bootstrap)
+                return;
+
+        stable = vrr->pset_changed +
+                msecs_to_jiffies(VRR_BOOT_STABLE * VRR_HPKT_MIN_DELAY);
+        if (!vrr->active && pstate->la_size + pstate->lna_size &&
+            time_after_eq(jiffies, stable)) {
+                VRR_INFO("Pset stable, activating");
+                vrr_set_active(vrr);
+        }
+
+        if (vrr->active || time_after_eq(jiffies, vrr->boot_start +
+                                         msecs_to_jiffies(VRR_BOOT_TIMEOUT))) {
+                VRR_DBG("Bootstrap done");
+                vrr->bootstrap = 0;
+        }
 }
 
-void active_timeout() {
+/* Neighbors learn that we turned active from our next hello */
+void vrr_set_active(struct vrr_node *vrr) {
         if (vrr->active)
                 return;
-        if (++vrr->timeout == VRR_ACTIVE_TIMEOUT)
-                vrr->active = 1;
+        vrr->active = 1;
+        vrr_hello_fast(vrr);
+}
+
+/* A setup_req we originated. Its delayed work retransmits it through
+ * another proxy with exponential backoff until the virtual neighbor
+ * is no longer wanted or VRR_SETUP_TRIES run out. Only that work and
+ * vrr_setup_exit free an entry; an answer just marks it done. */
+struct vrr_setup_pending {
+        struct list_head list;
+        struct delayed_work work;
+        struct vrr_node *vrr;
+        u32 dest;
+        u32 proxy;
+        int tries;
+        unsigned int delay;     /* milliseconds */
+        int done;
+};
+
+static unsigned long vrr_setup_delay(unsigned int delay)
+{
+        unsigned int spread = delay * VRR_HPKT_JITTER / 100;
+
+        return msecs_to_jiffies(delay - spread +
+                                net_random() % (2 * spread + 1));
 }
 
-void reset_active_timeout() {
-	vrr->timeout = 0;
+/* A request for our own id is how an inactive node joins the ring */
+static int vrr_setup_wanted(struct vrr_node *vrr, u32 dest)
+{
+        if (dest == vrr->id)
+                return !vrr->active;
+        return vset_should_add(vrr, dest);
+}
+
+static void vrr_setup_retry(struct work_struct *work)
+{
+        struct vrr_setup_pending *p = container_of(work,
+                                                   struct vrr_setup_pending,
+                                                   work.work);
+        struct vrr_node *vrr = p->vrr;
+        u32 dest = p->dest, proxy = 0;
+        unsigned long flags;
+        int wanted;
+
+        spin_lock_irqsave(&vrr->setup_lock, flags);
+        if (vrr->setup_stop) {
+                spin_unlock_irqrestore(&vrr->setup_lock, flags);
+                return;
+        }
+
+        /* done is set and cleared under setup_lock */
+        wanted = !p->done && vrr_setup_wanted(vrr, dest);
+
+        if (!wanted || p->tries == VRR_SETUP_TRIES) {
+                if (wanted) {
+                        VRR_DBG("Giving up on setup_req to %x", dest);
+                        VRR_INC_STAT(vrr, VRR_STAT_SETUP_GIVEUP);
+                }
+                list_del(&p->list);
+                spin_unlock_irqrestore(&vrr->setup_lock, flags);
+                kfree(p);
+                return;
+        }
+
+        p->tries++;
+        p->delay = min(2 * p->delay, (unsigned int)VRR_SETUP_RETRY_MAX);
+        if (pset_get_proxy(vrr, dest, p->proxy, &proxy))
+                p->proxy = proxy;
+        queue_delayed_work(vrr_wq, &p->work, vrr_setup_delay(p->delay));
+        spin_unlock_irqrestore(&vrr->setup_lock, flags);
+
+        if (proxy) {
+                VRR_DBG("Retrying setup_req to %x through %x", dest, proxy);
+                VRR_INC_STAT(vrr, VRR_STAT_SETUP_RETRY);
+                send_setup_req(vrr, vrr->id, dest, proxy);
+        }
+}
+
+/* Send a setup_req from us for dest and keep retransmitting it until
+ * it is answered. A request already in progress for dest is left to
+ * its own retransmissions. */
+int vrr_request_setup(struct vrr_node *vrr, u32 dest, u32 proxy)
+{
+        struct vrr_setup_pending *p;
+        unsigned long flags;
+
+        spin_lock_irqsave(&vrr->setup_lock, flags);
+        list_for_each_entry(p, &vrr->setup_pending, list)
+                if (p->dest == dest)
+                        break;
+
+        if (&p->list != &vrr->setup_pending) {
+                if (!p->done) {
+                        spin_unlock_irqrestore(&vrr->setup_lock, flags);
+                        return 0;
+                }
+                /* answered before, but wanted again */
+                p->done = 0;
+        } else if (!vrr->setup_stop) {
+                p = kmalloc(sizeof(struct vrr_setup_pending), GFP_ATOMIC);
+                if (p) {
+                        INIT_DELAYED_WORK(&p->work, vrr_setup_retry);
+                        p->vrr = vrr;
+                        p->dest = dest;
+                        p->done = 0;
+                        list_add(&p->list, &vrr->setup_pending);
+                        queue_delayed_work(vrr_wq, &p->work,
+                                           vrr_setup_delay(VRR_SETUP_RETRY));
+                }
+        } else {
+                p = NULL;
+        }
+
+        if (p) {
+                p->proxy = proxy;
+                p->tries = 0;
+                p->delay = VRR_SETUP_RETRY;
+        }
+        spin_unlock_irqrestore(&vrr->setup_lock, flags);
+
+        return send_setup_req(vrr, vrr->id, dest, proxy);
+}
+
+/* A setup or setup_fail from node answered our request */
+void vrr_setup_done(struct vrr_node *vrr, u32 node)
+{
+        struct vrr_setup_pending *p;
+        unsigned long flags;
+
+        spin_lock_irqsave(&vrr->setup_lock, flags);
+        list_for_each_entry(p, &vrr->setup_pending, list)
+                if (p->dest == node)
+                        p->done = 1;
+        spin_unlock_irqrestore(&vrr->setup_lock, flags);
+}
+
+void vrr_setup_exit(struct vrr_node *vrr)
+{
+        struct vrr_setup_pending *p, *q;
+        unsigned long flags;
+        LIST_HEAD(pending);
+
+        spin_lock_irqsave(&vrr->setup_lock, flags);
+        vrr->setup_stop = 1;
+        list_splice_init(&vrr->setup_pending, &pending);
+        spin_unlock_irqrestore(&vrr->setup_lock, flags);
+
+        list_for_each_entry_safe(p, q, &pending, list) {
+                cancel_delayed_work_sync(&p->work);
+                list_del(&p->list);
+                kfree(p);
+        }
 }
 
 /*build and send a setup request*/
-int send_setup_req(u_int src, u_int dest, u_int proxy)
+int send_setup_req(struct vrr_node *vrr, u_int src, u_int dest, u_int proxy)
 {
         unsigned char proxy_mac[ETH_ALEN];
 	struct sk_buff *skb;
@@ -157,7 +760,7 @@ int send_setup_req(u_int src, u_int dest, u_int proxy)
 
         VRR_DBG("src: %x, dest: %x, proxy: %x", src, dest, proxy);
 
-	pset_get_mac(proxy, proxy_mac);
+	pset_get_mac(vrr, proxy, proxy_mac);
 
         VRR_DBG("proxy_mac: %x:%x:%x:%x:%x:%x",
                 proxy_mac[0], 
@@ -167,7 +770,7 @@ int send_setup_req(u_int src, u_int dest, u_int proxy)
                 proxy_mac[4], 
                 proxy_mac[5]);
 
-  	vset_size = vset_get_all(&vset);
+  	vset_size = vset_get_all(vrr, &vset);
         data_size = sizeof(u_int) * (vset_size + 2);
 
 	setup_req_data = kmalloc(data_size, GFP_ATOMIC);
@@ -197,8 +800,8 @@ int send_setup_req(u_int src, u_int dest, u_int proxy)
 	setup_req_pkt.pkt_type = VRR_SETUP_REQ;
         memcpy(setup_req_pkt.dest_mac, proxy_mac, ETH_ALEN);
 
-        build_header(skb, &setup_req_pkt);
-        vrr_output(skb, vrr_get_node(), VRR_SETUP_REQ);
+        build_header(vrr, skb, &setup_req_pkt);
+        vrr_output(skb, vrr, VRR_SETUP_REQ);
 
 	kfree(setup_req_data);
         kfree(vset);
@@ -213,8 +816,8 @@ fail:
 
 
 
-int send_setup(u32 src, u32 dest, u32 path_id, u32 proxy, u32 vset_size,
-               u32 *vset, u32 to)
+int send_setup(struct vrr_node *vrr, u32 src, u32 dest, u32 path_id,
+               u32 proxy, u32 vset_size, u32 *vset, u32 to)
 {
         struct sk_buff *skb;
         struct vrr_packet setup_pkt;
@@ -223,7 +826,7 @@ int send_setup(u32 src, u32 dest, u32 path_id, u32 proxy, u32 vset_size,
         int i, p = 0;
         unsigned char dest_mac[ETH_ALEN];
 
-        if (!pset_get_mac(to, dest_mac)) {
+        if (!pset_get_mac(vrr, to, dest_mac)) {
                 VRR_ERR("Sending setup msg to unconnected node: %x", to);
                 return -1;
         }
@@ -256,14 +859,14 @@ int send_setup(u32 src, u32 dest, u32 path_id, u32 proxy, u32 vset_size,
         setup_pkt.pkt_type = VRR_SETUP;
         memcpy(setup_pkt.dest_mac, dest_mac, ETH_ALEN);
 
-        build_header(skb, &setup_pkt);
-        vrr_output(skb, vrr_get_node(), VRR_SETUP);
+        build_header(vrr, skb, &setup_pkt);
+        vrr_output(skb, vrr, VRR_SETUP);
 
 	return 0;
 }
 
-int send_setup_fail(u32 src, u32 dst, u32 proxy, u32 vset_size,
-			u32 *vset, u32 to)
+int send_setup_fail(struct vrr_node *vrr, u32 src, u32 dst, u32 proxy,
+			u32 vset_size, u32 *vset, u32 to)
 {
 	struct sk_buff *skb;
         struct vrr_packet setup_fail_pkt;
@@ -272,7 +875,7 @@ int send_setup_fail(u32 src, u32 dst, u32 proxy, u32 vset_size,
         int i, p = 0;
         unsigned char dest_mac[ETH_ALEN];
 
-        if (!pset_get_mac(to, dest_mac)) {
+        if (!pset_get_mac(vrr, to, dest_mac)) {
                 VRR_ERR("Sending setup_fail to unconnected node: %x", to);
                 return -1;
         }
@@ -302,13 +905,13 @@ int send_setup_fail(u32 src, u32 dst, u32 proxy, u32 vset_size,
         setup_fail_pkt.pkt_type = VRR_SETUP_FAIL;
         memcpy(setup_fail_pkt.dest_mac, dest_mac, ETH_ALEN);
 
-        build_header(skb, &setup_fail_pkt);
-        vrr_output(skb, vrr_get_node(), VRR_SETUP_FAIL);
+        build_header(vrr, skb, &setup_fail_pkt);
+        vrr_output(skb, vrr, VRR_SETUP_FAIL);
 
 	return 0;
 }
 
-int send_teardown(u32 path_id, u32 endpoint, u32 *vset, 
+int send_teardown(struct vrr_node *vrr, u32 path_id, u32 endpoint, u32 *vset, 
 			u32 vset_size, u32 to) 
 {
 	
@@ -321,7 +924,7 @@ int send_teardown(u32 path_id, u32 endpoint, u32 *vset,
 
 
 	VRR_DBG("Building teardown packet");
-	if(!pset_get_mac(to, dest_mac)) 
+	if(!pset_get_mac(vrr, to, dest_mac)) 
 		return -1;
 
 	VRR_DBG("ea: %x", endpoint);
@@ -346,43 +949,84 @@ int send_teardown(u32 path_id, u32 endpoint, u32 *vset,
                 return -1;
         }
 
-        teardown_pkt.src = get_vrr_id();
+        teardown_pkt.src = get_vrr_id(vrr);
         teardown_pkt.dst = to;
         teardown_pkt.data_len = data_size;
         teardown_pkt.pkt_type = VRR_TEARDOWN;
         memcpy(teardown_pkt.dest_mac, dest_mac, ETH_ALEN);
         
-        build_header(skb, &teardown_pkt);
-        vrr_output(skb, vrr_get_node(), VRR_TEARDOWN);
+        build_header(vrr, skb, &teardown_pkt);
+        vrr_output(skb, vrr, VRR_TEARDOWN);
 
 	return 0;
 }
 	
-int tear_down_path(u32 path_id, u32 endpoint, u32 sender)
+/* Repair frames carry the route <ea, eb, path_id> and the next hops
+ * the relay is to use for it, see vrr_repair_routes() */
+int send_repair(struct vrr_node *vrr, u32 step, u32 ea, u32 eb, u32 path_id,
+		u32 na, u32 nb, u32 to)
+{
+	struct sk_buff *skb;
+	struct vrr_packet repair_pkt;
+	u32 repair_data[6];
+	unsigned char dest_mac[ETH_ALEN];
+
+	if (!pset_get_mac(vrr, to, dest_mac))
+		return -1;
+
+	repair_data[0] = htonl(step);
+	repair_data[1] = htonl(ea);
+	repair_data[2] = htonl(eb);
+	repair_data[3] = htonl(path_id);
+	repair_data[4] = htonl(na);
+	repair_data[5] = htonl(nb);
+
+	skb = vrr_skb_alloc(sizeof(repair_data), GFP_ATOMIC);
+	if (!skb) {
+		VRR_ERR("Failed to alloc skb.");
+		return -1;
+	}
+	memcpy(skb_put(skb, sizeof(repair_data)), repair_data,
+	       sizeof(repair_data));
+
+	repair_pkt.src = get_vrr_id(vrr);
+	repair_pkt.dst = to;
+	repair_pkt.data_len = sizeof(repair_data);
+	repair_pkt.pkt_type = VRR_REPAIR;
+	memcpy(repair_pkt.dest_mac, dest_mac, ETH_ALEN);
+
+	build_header(vrr, skb, &repair_pkt);
+	vrr_output(skb, vrr, VRR_REPAIR);
+
+	return 0;
+}
+
+int tear_down_path(struct vrr_node *vrr, u32 path_id, u32 endpoint,
+		   u32 sender)
 {
 	rt_entry *route;
 	u32 *vset, vset_size = 0;
  
-	route = rt_remove_route(endpoint, path_id);
+	route = rt_remove_route(vrr, endpoint, path_id);
 
 	if (route) {
-		if (route->na && pset_contains(route->na)) {
+		if (route->na && pset_contains(vrr, route->na)) {
 			if (sender)
-				vset_size = vset_get_all(&vset);
-			send_teardown(path_id, endpoint, vset, vset_size, 
+				vset_size = vset_get_all(vrr, &vset);
+			send_teardown(vrr, path_id, endpoint, vset, vset_size, 
                                       route->na);	
 		}
 	        vset = 0;	
-		if (route->nb && pset_contains(route->nb)) {
+		if (route->nb && pset_contains(vrr, route->nb)) {
 			if (sender)
-				vset_size = vset_get_all(&vset);
-			send_teardown(path_id, endpoint, vset, vset_size, 
+				vset_size = vset_get_all(vrr, &vset);
+			send_teardown(vrr, path_id, endpoint, vset, vset_size, 
                                       route->nb);
 		}
 		vset = 0;
-		if (sender && pset_contains(sender)) {
-			vset_size = vset_get_all(&vset);
-			send_teardown(path_id, endpoint, vset, vset_size, 
+		if (sender && pset_contains(vrr, sender)) {
+			vset_size = vset_get_all(vrr, &vset);
+			send_teardown(vrr, path_id, endpoint, vset, vset_size, 
                                       sender);
 		}
 	}
@@ -404,32 +1048,60 @@ int tear_down_path(u32 path_id, u32 endpoint, u32 sender)
  *      3: Setup
  *      4: Setup fail
  *      5: Teardown
+ *      6: Delta hello
+ *      7: Local repair
+ *      8: Aggregate of data frames
+ *      9: Fragment of a data frame
  *
  * Protocol type: vrr id, 8 bits
  * Total length: length of the data 16  bits
- * Open Space: 8 bits reserved for future use
+ * Hop limit: 6 bits
+ * Traffic class: 2 bits, VRR_TC_CTL for all but data
  * Header checksum: 16bits
  * Source id: 32 bits
  * Destination id: 32 bits
  * Destination Mac: 48 bits
  *
+ * Data frames that need no fragmenting carry the compact version 3
+ * header instead: version, packet type, total length, hop limit and
+ * class, source id and destination id, 13 bytes in all. Version 4
+ * adds a label after it: the endpoint and path id of the route taken.
+ *
 */
 
-int build_header(struct sk_buff *skb, struct vrr_packet *vpkt)
+int build_header(struct vrr_node *vrr, struct sk_buff *skb,
+		 struct vrr_packet *vpkt)
 {
 	struct vrr_header header;
+	struct vrr_data_header *ch;
+
+	/* Data frames that fit the link unfragmented get the compact
+	 * header; their next hop MAC stays with the skb */
+	if (vpkt->pkt_type == VRR_DATA && compact &&
+	    sizeof(struct vrr_data_header) + vpkt->data_len <= vrr->mtu) {
+		ch = (struct vrr_data_header *)skb_push(skb, sizeof(*ch));
+		ch->vrr_version = VRR_VERSION_COMPACT;
+		ch->pkt_type = VRR_DATA;
+		ch->data_len = htons(vpkt->data_len);
+		ch->hop_limit = VRR_HOP_LIMIT;
+		ch->src_id = htonl(vpkt->src);
+		ch->dest_id = htonl(vpkt->dst);
+		memcpy(VRR_SKB_CB(skb)->dest_mac, vpkt->dest_mac, ETH_ALEN);
+		vrr_set_tclass(skb, VRR_TC_BE);
+		return 0;
+	}
 
 	header.vrr_version = vrr->version;
 	header.pkt_type = vpkt->pkt_type;
 	header.protocol = htons(PF_VRR);
 	header.data_len = htons(vpkt->data_len);
-	header.free = 0;
+	header.hop_limit = VRR_HOP_LIMIT;
 	header.h_csum = 0;
 	header.src_id = htonl(vpkt->src);
 	header.dest_id = htonl(vpkt->dst);
 
 	//determine what kind of header
-	if (vpkt->pkt_type == VRR_HELLO)
+	if (vpkt->pkt_type == VRR_HELLO || vpkt->pkt_type == VRR_HELLO_DELTA)
                 memset(header.dest_mac, -1, ETH_ALEN);
         else
 		memcpy(header.dest_mac, vpkt->dest_mac, ETH_ALEN);
@@ -438,9 +1110,52 @@ int build_header(struct sk_buff *skb, struct vrr_packet *vpkt)
 	memcpy(skb_push(skb, sizeof(struct vrr_header)), &header,
 	       sizeof(struct vrr_header));
 
+	vrr_set_tclass(skb, vpkt->pkt_type == VRR_DATA ? VRR_TC_BE :
+		       VRR_TC_CTL);
 	return 0;
 }
 
+/* Mark the frame built in skb with tclass. Its skb->priority keeps
+ * control frames ahead of data in the device queue. */
+void vrr_set_tclass(struct sk_buff *skb, u8 tclass)
+{
+	struct vrr_header *vh = (struct vrr_header *)skb->data;
+
+	vrr_hdr_set_hops(vh, (vrr_hdr_hops(vh) & VRR_HOP_MASK) |
+			 (tclass << VRR_TC_SHIFT));
+	skb->priority = vrr_tc_prio(tclass);
+}
+
+/* Label the compact data frame built in skb with the route <endpoint,
+ * path_id> it is sent on. Relays then look the route up by its path
+ * id instead of searching the routing table. A frame that is already
+ * labelled gets the new route; others only when the label parameter
+ * is set and the label still fits the link. */
+void vrr_set_label(struct vrr_node *vrr, struct sk_buff *skb, u32 endpoint,
+		   u32 path_id)
+{
+	const unsigned int hlen = sizeof(struct vrr_data_header);
+	struct vrr_header *vh = (struct vrr_header *)skb->data;
+	struct vrr_label *l;
+
+	if (!path_id || !vrr_hdr_compact(vh))
+		return;
+
+	if (vh->vrr_version == VRR_VERSION_COMPACT) {
+		if (!label || skb->len + sizeof(*l) > vrr->mtu ||
+		    skb_cow_head(skb, sizeof(*l) + ETH_HLEN))
+			return;
+		vh = (struct vrr_header *)skb_push(skb, sizeof(*l));
+		memmove(vh, skb->data + sizeof(*l), hlen);
+		vh->vrr_version = VRR_VERSION_LABEL;
+		skb_reset_network_header(skb);
+	}
+
+	l = (struct vrr_label *)(skb->data + hlen);
+	l->endpoint = htonl(endpoint);
+	l->path_id = htonl(path_id);
+}
+
 int rmv_vrr_header(struct sk_buff *skb)
 {
 	/*remove the header for handoff to the socket layer
@@ -471,6 +1186,152 @@ int rmv_vrr_header(struct sk_buff *skb)
 
 
 
+/* Remember the lists advertised by a full hello. Delta hellos carry
+ * only the entries that differ from them. */
+static void hello_set_base(struct pset_state *pstate)
+{
+        int i, n = 0;
+
+        for (i = 0; i < pstate->la_size; i++, n++) {
+                pstate->base_id[n] = pstate->l_active[i];
+                pstate->base_list[n] = VRR_HELLO_LA;
+        }
+        for (i = 0; i < pstate->lna_size; i++, n++) {
+                pstate->base_id[n] = pstate->l_not_active[i];
+                pstate->base_list[n] = VRR_HELLO_LNA;
+        }
+        for (i = 0; i < pstate->p_size; i++, n++) {
+                pstate->base_id[n] = pstate->pending[i];
+                pstate->base_list[n] = VRR_HELLO_P;
+        }
+        pstate->base_size = n;
+        pstate->base_seq = pstate->hello_seq;
+}
+
+static int hello_base_find(struct pset_state *pstate, u32 id)
+{
+        int i;
+
+        for (i = 0; i < pstate->base_size; i++)
+                if (pstate->base_id[i] == id)
+                        return pstate->base_list[i];
+        return VRR_HELLO_GONE;
+}
+
+static int hello_lists_contain(u32 **lists, int *sizes, u32 id)
+{
+        int i, j;
+
+        for (j = 0; j < 3; j++)
+                for (i = 0; i < sizes[j]; i++)
+                        if (lists[j][i] == id)
+                                return 1;
+        return 0;
+}
+
+static int hello_delta_add(u32 *delta, int n, u32 id, int list)
+{
+        if (n < VRR_HELLO_DELTA_MAX) {
+                delta[2 * n] = htonl(id);
+                delta[2 * n + 1] = htonl(list);
+        }
+        return n + 1;
+}
+
+/* Fill delta with the (id, list) pairs that changed since the last
+ * full hello. Returns the number of changes, which may exceed
+ * VRR_HELLO_DELTA_MAX; only that many are stored. */
+static int hello_delta(struct pset_state *pstate, u32 *delta)
+{
+        u32 *lists[3] = {pstate->l_active, pstate->l_not_active,
+                         pstate->pending};
+        int sizes[3] = {pstate->la_size, pstate->lna_size, pstate->p_size};
+        int i, j, k, n = 0;
+
+        for (j = 0; j < 3; j++)
+                for (i = 0; i < sizes[j]; i++)
+                        if (hello_base_find(pstate, lists[j][i]) != j)
+                                n = hello_delta_add(delta, n, lists[j][i], j);
+
+        for (k = 0; k < pstate->base_size; k++)
+                if (!hello_lists_contain(lists, sizes, pstate->base_id[k]))
+                        n = hello_delta_add(delta, n, pstate->base_id[k],
+                                            VRR_HELLO_GONE);
+        return n;
+}
+
+/* Delta hello: <active, seq, base_seq, n, (id, list) * n>. Receivers
+ * that lost the base full hello ignore it and wait for the next. */
+static int send_hpkt_delta(struct vrr_node *vrr, u32 *delta, int n)
+{
+	struct pset_state *pstate = vrr->pstate;
+	struct sk_buff *skb;
+	struct vrr_packet hpkt;
+	u32 *hpkt_data;
+	int data_size = sizeof(u32) * (4 + 2 * n);
+
+	skb = vrr_skb_alloc(data_size, GFP_ATOMIC);
+	if (!skb) {
+		VRR_ERR("delta hello skb buff failed");
+		return -1;
+	}
+
+	hpkt_data = (u32 *) skb_put(skb, data_size);
+	hpkt_data[0] = htonl(vrr->active);
+	hpkt_data[1] = htonl(++pstate->hello_seq);
+	hpkt_data[2] = htonl(pstate->base_seq);
+	hpkt_data[3] = htonl(n);
+	memcpy(&hpkt_data[4], delta, 2 * n * sizeof(u32));
+
+	hpkt.src = vrr->id;
+	hpkt.dst = 0;                      /* broadcast addr */
+	hpkt.data_len = data_size;
+	hpkt.pkt_type = VRR_HELLO_DELTA;
+	build_header(vrr, skb, &hpkt);
+	vrr_output(skb, vrr, VRR_HELLO_DELTA);
+
+	return 0;
+}
+
+/* Called from the hello timer. A hello is skipped while every
+ * neighbor is linked and got a unicast frame from us within the last
+ * interval, which shows it we are alive; once the pset changed,
+ * neighbors that understand deltas get only the changes. Either way
+ * a full hello goes out at least every VRR_HELLO_FULL_MAX periods. */
+void vrr_send_hello(struct vrr_node *vrr, int changed)
+{
+        struct pset_state *pstate = vrr->pstate;
+        u32 delta[2 * VRR_HELLO_DELTA_MAX];
+        unsigned long now = jiffies;
+        int n;
+
+        if (vrr->bootstrap || !pstate->base_seq ||
+            time_after_eq(now, vrr->full_sent +
+                          msecs_to_jiffies(VRR_HELLO_FULL_MAX *
+                                           VRR_HPKT_DELAY)))
+                goto full;
+
+        if (!changed &&
+            pset_hello_quiet(vrr, now - msecs_to_jiffies(vrr->hello_delay))) {
+                VRR_DBG("Neighbors heard from us, no hello");
+                return;
+        }
+
+        if (!pset_hello_deltas(vrr))
+                goto full;
+
+        n = hello_delta(pstate, delta);
+        if (n > VRR_HELLO_DELTA_MAX)
+                goto full;
+
+        if (!send_hpkt_delta(vrr, delta, n))
+                return;
+
+ full:
+        if (!send_hpkt(vrr))
+                vrr->full_sent = now;
+}
+
 /*build and send a hello packet */
 
 	/* Creates an sk_buff. Stuffs with
@@ -481,8 +1342,9 @@ int rmv_vrr_header(struct sk_buff *skb)
 	 * header which wraps the header around
 	 * packet. Pass to vrr_output
 	 */
-int send_hpkt()
+int send_hpkt(struct vrr_node *vrr)
 {
+	struct pset_state *pstate = vrr->pstate;
 	struct sk_buff *skb;
 	struct vrr_packet hpkt;
 	int data_size, i = 0, p = 0;
@@ -494,7 +1356,7 @@ int send_hpkt()
 
         data_size = sizeof(u32) * (pstate->la_size +
                                      pstate->lna_size +
-                                     pstate->p_size + 4);
+                                     pstate->p_size + 5);
 
         hpkt_data = (u32 *) kmalloc(data_size, GFP_ATOMIC);
 
@@ -525,6 +1387,9 @@ int send_hpkt()
                 hpkt_data[p++] = htonl(pstate->pending[i]);
 	}
 
+        /* Trailing seq, ignored by nodes that don't send deltas */
+        hpkt_data[p++] = htonl(++pstate->hello_seq);
+
 	skb = vrr_skb_alloc(data_size, GFP_ATOMIC);
 	if (skb)
                 memcpy(skb_put(skb, data_size), hpkt_data, data_size);
@@ -535,8 +1400,9 @@ int send_hpkt()
 	hpkt.dst = 0;                      /* broadcast addr */
 	hpkt.data_len = data_size;
 	hpkt.pkt_type = VRR_HELLO;
-	build_header(skb, &hpkt);
-	vrr_output(skb, vrr_get_node(), VRR_HELLO);
+	build_header(vrr, skb, &hpkt);
+	vrr_output(skb, vrr, VRR_HELLO);
+        hello_set_base(pstate);
 
         kfree(hpkt_data);
 	return 0;
@@ -546,7 +1412,7 @@ int send_hpkt()
 	return -1;
 }
 
-int set_vrr_id(u_int vrr_id)
+int set_vrr_id(struct vrr_node *vrr, u_int vrr_id)
 {
 	if (vrr_id == 0) {
 		/*generate random unsigned int
@@ -570,96 +1436,90 @@ int set_vrr_id(u_int vrr_id)
 /*called by sysfs show function or
  * sockets module
  */
-u_int get_vrr_id()
+u_int get_vrr_id(struct vrr_node *vrr)
 {
 
 	return vrr->id;
 }
 
 
-u32 *get_pset_active()
+u32 *get_pset_active(struct vrr_node *vrr)
 {
-	return pstate->l_active;
+	return vrr->pstate->l_active;
 }
 
-u32 *get_pset_not_active()
+u32 *get_pset_not_active(struct vrr_node *vrr)
 {
-	return pstate->l_not_active;
+	return vrr->pstate->l_not_active;
 }
 
-u32 *get_pset_pending()
+u32 *get_pset_pending(struct vrr_node *vrr)
 {
 
-	return pstate->pending;
+	return vrr->pstate->pending;
 }
 
-int get_pset_active_size()
+int get_pset_active_size(struct vrr_node *vrr)
 {
-	return pstate->la_size * sizeof(u32);
+	return vrr->pstate->la_size * sizeof(u32);
 }
 
-int get_pset_not_active_size()
+int get_pset_not_active_size(struct vrr_node *vrr)
 {
-	return pstate->lna_size * sizeof(u32);
+	return vrr->pstate->lna_size * sizeof(u32);
 }
 
-int get_pset_pending_size()
+int get_pset_pending_size(struct vrr_node *vrr)
 {
-	return pstate->p_size * sizeof(u32);
+	return vrr->pstate->p_size * sizeof(u32);
 }
 
-mac_addr *get_pset_active_mac()
+mac_addr *get_pset_active_mac(struct vrr_node *vrr)
 {
-	return pstate->la_mac;
+	return vrr->pstate->la_mac;
 }
 
-mac_addr *get_pset_not_active_mac()
+mac_addr *get_pset_not_active_mac(struct vrr_node *vrr)
 {
-	return pstate->lna_mac;
+	return vrr->pstate->lna_mac;
 }
 
-mac_addr *get_pset_pending_mac()
+mac_addr *get_pset_pending_mac(struct vrr_node *vrr)
 {
-	return pstate->pending_mac;
+	return vrr->pstate->pending_mac;
 }
 
-int get_pset_active_mac_size()
+int get_pset_active_mac_size(struct vrr_node *vrr)
 {
-	return pstate->lam_size * sizeof(mac_addr);
+	return vrr->pstate->lam_size * sizeof(mac_addr);
 }
 
-int get_pset_not_active_mac_size()
+int get_pset_not_active_mac_size(struct vrr_node *vrr)
 {
-	return pstate->lnam_size * sizeof(mac_addr);
+	return vrr->pstate->lnam_size * sizeof(mac_addr);
 }
 
-int get_pset_pending_mac_size()
+int get_pset_pending_mac_size(struct vrr_node *vrr)
 {
-	return pstate->pm_size * sizeof(mac_addr);
+	return vrr->pstate->pm_size * sizeof(mac_addr);
 }
 
-struct vrr_node* vrr_get_node()
-{
- 	return vrr;
-}
-
-
-int vrr_add(u32 src, u32 vset_size, u32 *vset)
+int vrr_add(struct vrr_node *vrr, u32 src, u32 vset_size, u32 *vset)
 {
 	u32 i, proxy, rem = 0, ret;
-        u32 me = get_vrr_id();
+        u32 me = get_vrr_id(vrr);
 
 	for (i = 0; i < vset_size; i++)
-		if (vset_should_add(vset[i])) {
-			ret = pset_get_proxy(&proxy);
+		if (vset_should_add(vrr, vset[i])) {
+			ret = pset_get_proxy(vrr, vset[i], 0, &proxy);
                         if (ret) {
                                 VRR_DBG("Sending setup_req: me=%x, vset[%x]=%x, proxy=%x", me, i, vset[i], proxy);
-                                send_setup_req(me, vset[i], proxy);
+                                vrr_request_setup(vrr, vset[i], proxy);
                         }
 		}
-        if (src != -1 && vset_should_add(src)) {
+        if (src != -1 && vset_should_add(vrr, src)) {
                 VRR_DBG("Adding src: %x", src);
-                ret = vset_add(src, &rem);
+                ret = vset_add(vrr, src, &rem);
 		if (ret > 0) {
 			/* TearDownPathTo(rem) */
                         VRR_DBG("Should tear down path to %x", rem);
@@ -673,11 +1533,10 @@ u32 vrr_new_path_id()
 {
         u32 id;
 
-        get_random_bytes(&id, sizeof(u32));
+        /* 0 stands for no path in a label */
+        do {
+                get_random_bytes(&id, sizeof(u32));
+        } while (!id);
         /* TODO: Check for existence in our vset */
         return id;
 }
-
-//TODO vrr exit node: release vrr node memory
-//                    release pset_state memory
-//		      stop timer
@@ -9,17 +9,11 @@ and linked list at each node: http://isis.poly.edu/kulesh/stuff/src/klist/
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
 #include <linux/sort.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
 #include "vrr.h"
 #include "vrr_data.h"
 
-//My Node
-static u_int ME;
-
-//spin locks
-static DEFINE_SPINLOCK(vrr_rt_lock);
-static DEFINE_SPINLOCK(vrr_vset_lock);
-static DEFINE_SPINLOCK(vrr_pset_lock);
-
 //Routing Table Setup
 /* typedef struct routes_list { */
 /*	rt_entry		route; */
@@ -32,11 +26,6 @@ typedef struct rt_node {
 	rt_entry	routes;
 } rt_node_t;
 
-static struct rb_root rt_root;
-
-static int pset_size = 0;
-static pset_list_t pset;
-
 //Virtual Set Setup
 typedef struct vset_list {
 	struct list_head	list;
@@ -45,43 +34,121 @@ typedef struct vset_list {
 	int			diff_right;
 } vset_list_t;
 
-static int vset_size = 0;
-static vset_list_t vset;
+//A data flow and the next hop it was given
+struct vrr_flow {
+	u32			src;
+	u32			dst;
+	u32			nh;
+	unsigned long		stamp;	//jiffies, 0 if unused
+};
+
+//Per node routing state
+struct vrr_data {
+	//spin locks
+	spinlock_t		rt_lock;
+	spinlock_t		vset_lock;
+	spinlock_t		pset_lock;
+	spinlock_t		flow_lock;
+
+	struct vrr_flow		flows[VRR_FLOW_SIZE];
+
+	struct rb_root		rt_root;
+	struct hlist_head	rt_label[VRR_LABEL_SIZE];	//by path id
+
+	int			pset_size;
+	pset_list_t		pset;
+
+	int			vset_size;
+	vset_list_t		vset;
+};
 
 //internal functions
 u_int get_diff(u_int x, u_int y);
-void insert_vset_node(u_int node);
+void insert_vset_node(struct vrr_node *vrr, u_int node);
 static rt_node_t *rt_find_insert_node(struct rb_root *root, u32 endpoint);
-u_int rt_search(struct rb_root *root, u32 endpoint);
-rt_entry *rt_search_rmv(struct rb_root *root, u32 endpoint, u32 path_id);
-u_int rt_search_exclude(struct rb_root *root, u32 endpoint, u32 src);
-u_int route_list_search(rt_entry* r_list, u32 endpoint);
-rt_entry *route_list_search_rmv(rt_entry *r_list, u32 endpoint, u32 path_id);
+static rt_node_t *rt_find_node(struct rb_root *root, u32 endpoint);
+u_int rt_search(struct vrr_node *vrr, u32 endpoint);
+rt_entry *rt_search_rmv(struct vrr_node *vrr, u32 endpoint, u32 path_id);
+u_int rt_search_exclude(struct vrr_node *vrr, u32 endpoint, u32 src);
+u_int route_list_search(struct vrr_node *vrr, rt_entry* r_list, u32 endpoint);
+rt_entry *route_list_search_rmv(struct vrr_node *vrr, rt_entry *r_list,
+				u32 endpoint, u32 path_id);
 
-int vset_bump(u32 *rem);
+int vset_bump(struct vrr_node *vrr, u32 *rem);
 
-void vrr_data_init()
+int vrr_data_init(struct vrr_node *vrr)
 {
+	struct vrr_data *d;
+	int i;
+
 	printk(KERN_ALERT "vrr_data_init enter\n");
-	ME = get_vrr_id();
-	rt_root = RB_ROOT;	//Initialize the routing table Tree
-	INIT_LIST_HEAD(&pset.list);
-	INIT_LIST_HEAD(&vset.list);
+	d = kmalloc(sizeof(struct vrr_data), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+
+	spin_lock_init(&d->rt_lock);
+	spin_lock_init(&d->vset_lock);
+	spin_lock_init(&d->pset_lock);
+	spin_lock_init(&d->flow_lock);
+	memset(d->flows, 0, sizeof(d->flows));
+	d->rt_root = RB_ROOT;	//Initialize the routing table Tree
+	for (i = 0; i < VRR_LABEL_SIZE; i++)
+		INIT_HLIST_HEAD(&d->rt_label[i]);
+	d->pset_size = 0;
+	INIT_LIST_HEAD(&d->pset.list);
+	d->vset_size = 0;
+	INIT_LIST_HEAD(&d->vset.list);
+
+	vrr->data = d;
 	printk(KERN_ALERT "vrr_data_init leave\n");
+	return 0;
+}
+
+void vrr_data_exit(struct vrr_node *vrr)
+{
+	struct vrr_data *d = vrr->data;
+	struct rb_node *node;
+	rt_node_t *this;
+	rt_entry *route, *rtmp;
+	pset_list_t *p, *ptmp;
+	vset_list_t *v, *vtmp;
+
+	while ((node = rb_first(&d->rt_root))) {
+		this = rb_entry(node, rt_node_t, node);
+		list_for_each_entry_safe(route, rtmp, &this->routes.list, list) {
+			list_del(&route->list);
+			kfree(route);
+		}
+		rb_erase(node, &d->rt_root);
+		kfree(this);
+	}
+
+	list_for_each_entry_safe(p, ptmp, &d->pset.list, list) {
+		list_del(&p->list);
+		kfree(p);
+	}
+
+	list_for_each_entry_safe(v, vtmp, &d->vset.list, list) {
+		list_del(&v->list);
+		kfree(v);
+	}
+
+	kfree(d);
+	vrr->data = NULL;
 }
 
 /*
  * Returns the next hop in the routing table, given the destination
  * parameter.  Returns 0 when no route exists.
  */
-u_int rt_get_next(u32 dest)
+u_int rt_get_next(struct vrr_node *vrr, u32 dest)
 {
 	u32 next;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_rt_lock, flags);
-	next = rt_search(&rt_root, dest);
-	spin_unlock_irqrestore(&vrr_rt_lock, flags);
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
+	next = rt_search(vrr, dest);
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
 
 	return next;
 }
@@ -89,9 +156,9 @@ u_int rt_get_next(u32 dest)
 /*
  * Helper function to search the Red-Black Tree routing table
  */
-u32 rt_search(struct rb_root *root, u32 endpoint)
+u32 rt_search(struct vrr_node *vrr, u32 endpoint)
 {
-	struct rb_node *node = root->rb_node;	// top of the tree
+	struct rb_node *node = vrr->data->rt_root.rb_node;	// top of the tree
 
 	while (node) {
 		rt_node_t *this = rb_entry(node, rt_node_t, node);
@@ -101,17 +168,17 @@ u32 rt_search(struct rb_root *root, u32 endpoint)
 		else if (endpoint > this->endpoint)
 			node = node->rb_right;
 		else {
-			if (this->endpoint == ME)
+			if (this->endpoint == vrr->id)
 				return 0;
-			return route_list_search(&this->routes, endpoint);
+			return route_list_search(vrr, &this->routes, endpoint);
 		}
 	}
 	return 0;
 }
 
-rt_entry *rt_search_rmv(struct rb_root *root, u32 endpoint, u32 path_id)
+rt_entry *rt_search_rmv(struct vrr_node *vrr, u32 endpoint, u32 path_id)
 {
-	struct rb_node *node = root->rb_node;	// top of the tree
+	struct rb_node *node = vrr->data->rt_root.rb_node;	// top of the tree
 
 	while (node) {
 		rt_node_t *this = rb_entry(node, rt_node_t, node);
@@ -121,7 +188,8 @@ rt_entry *rt_search_rmv(struct rb_root *root, u32 endpoint, u32 path_id)
 		else if (endpoint > this->endpoint)
 			node = node->rb_right;
 		else
-			return route_list_search_rmv(&this->routes, endpoint, path_id);
+			return route_list_search_rmv(vrr, &this->routes,
+						     endpoint, path_id);
 
 	}
 	return NULL;
@@ -131,13 +199,13 @@ rt_entry *rt_search_rmv(struct rb_root *root, u32 endpoint, u32 path_id)
  * Returns the next hop in the routing table, given the destination
  * parameter. Excludes the src from the search. Returns 0 when no route exists.
  */
-u_int rt_get_next_exclude(u_int dest, u_int src)
+u_int rt_get_next_exclude(struct vrr_node *vrr, u_int dest, u_int src)
 {
 	u_int next;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_rt_lock, flags);
-	next = rt_search_exclude(&rt_root, dest, src);
-	spin_unlock_irqrestore(&vrr_rt_lock, flags);
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
+	next = rt_search_exclude(vrr, dest, src);
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
 
 	return next;
 }
@@ -145,9 +213,9 @@ u_int rt_get_next_exclude(u_int dest, u_int src)
 /*
  * Helper function to search the Red-Black Tree routing table, while excluding the src node
  */
-u_int rt_search_exclude(struct rb_root *root, u32 endpoint, u32 src)
+u_int rt_search_exclude(struct vrr_node *vrr, u32 endpoint, u32 src)
 {
-	struct rb_node *node = root->rb_node;	// top of the tree
+	struct rb_node *node = vrr->data->rt_root.rb_node;	// top of the tree
 	rt_node_t *this = NULL;
 	rt_node_t *prev = NULL;
 
@@ -156,24 +224,33 @@ u_int rt_search_exclude(struct rb_root *root, u32 endpoint, u32 src)
 		this = rb_entry(node, rt_node_t, node);
 
 		if (this->endpoint == src && prev)
-			return route_list_search(&prev->routes, endpoint);
+			return route_list_search(vrr, &prev->routes, endpoint);
 		else if (endpoint < this->endpoint)
 			node = node->rb_left;
 		else if (endpoint > this->endpoint)
 			node = node->rb_right;
 		else {
-			if (this->endpoint == ME)
+			if (this->endpoint == vrr->id)
 				return 0;
-			return route_list_search(&this->routes, endpoint);
+			return route_list_search(vrr, &this->routes, endpoint);
 		}
 	}
 	return 0;
 }
 
+/* Next hop of route toward endpoint, from the end closest to it */
+static u32 rt_entry_next(struct vrr_node *vrr, rt_entry *route, u32 endpoint)
+{
+	if (get_diff(endpoint, route->ea) < get_diff(endpoint, route->eb))
+		return (route->ea != vrr->id) ? route->na : route->nb;
+	else
+		return (route->eb != vrr->id) ? route->nb : route->na;
+}
+
 /* Helper function to search a list of route entries of a particular
  * node, for the next path node with the highest path_id
  */
-u_int route_list_search(rt_entry *r_list, u32 endpoint)
+u_int route_list_search(struct vrr_node *vrr, rt_entry *r_list, u32 endpoint)
 {
 	rt_entry *tmp = NULL;
 	rt_entry *max_entry = NULL;
@@ -194,38 +271,159 @@ u_int route_list_search(rt_entry *r_list, u32 endpoint)
 		return 0;
 	}
 
-	if(get_diff(endpoint, max_entry->ea) <
-	   get_diff(endpoint, max_entry->eb))
-		if (max_entry->ea != ME)
-			return max_entry->na;
-		else
-			return max_entry->nb;
-	else
-		if (max_entry->eb != ME)
-			return max_entry->nb;
-		else
-			return max_entry->na;
-	return 0;
+	return rt_entry_next(vrr, max_entry, endpoint);
 }
 
-rt_entry* route_list_search_rmv(rt_entry *r_list, u32 endpoint, u32 path_id)
+static inline struct hlist_head *rt_label_head(struct vrr_data *d,
+					       u32 path_id)
+{
+	return &d->rt_label[jhash_1word(path_id, 0) & (VRR_LABEL_SIZE - 1)];
+}
+
+/*
+ * Returns the next hop toward endpoint on the route with the given
+ * path_id, looked up by path id alone so that relays can follow a
+ * labelled frame without searching the tree.  Whether the next hop
+ * can be used is read from the index of linked nodes in the pset
+ * state, not by walking the pset, so both lookups are hashed.  Returns
+ * 0 when there is no such route, or its next hop can't be used.
+ */
+u32 rt_get_next_label(struct vrr_node *vrr, u32 endpoint, u32 path_id)
+{
+	struct vrr_data *d = vrr->data;
+	struct hlist_node *pos;
+	rt_entry *route;
+	unsigned long flags;
+	u32 next = 0;
+
+	spin_lock_irqsave(&d->rt_lock, flags);
+	hlist_for_each_entry(route, pos, rt_label_head(d, path_id), hnode) {
+		if (route->path_id != path_id ||
+		    (route->ea != endpoint && route->eb != endpoint))
+			continue;
+		if (endpoint != vrr->id)
+			next = rt_entry_next(vrr, route, endpoint);
+		break;
+	}
+	spin_unlock_irqrestore(&d->rt_lock, flags);
+
+	if (next && !pset_link_weight(vrr, next))
+		return 0;
+	return next;
+}
+
+/*
+ * Returns the next hop toward dest for the flow from src.  Every route
+ * to dest is a candidate.  A flow keeps the next hop it was given while
+ * that stays usable and the flow doesn't go idle for VRR_FLOW_TIMEOUT.
+ * New flows pick a route by rendezvous hashing on <src, dest, path_id>,
+ * biased by pset_link_weight() so that they avoid loaded and weak
+ * links.  Returns 0 when no route exists.
+ */
+u32 rt_get_next_flow(struct vrr_node *vrr, u32 dest, u32 src, u32 *path_id)
+{
+	struct vrr_data *d = vrr->data;
+	u32 hops[VRR_MULTIPATH_MAX], pids[VRR_MULTIPATH_MAX];
+	u32 score, best_score = 0, best = 0, best_pid = 0, cached = 0;
+	struct vrr_flow *flow;
+	rt_node_t *this;
+	rt_entry *route;
+	unsigned long flags, now = jiffies;
+	int i, n = 0, weight;
+
+	spin_lock_irqsave(&d->rt_lock, flags);
+	this = rt_find_node(&d->rt_root, dest);
+	if (this && dest != vrr->id) {
+		list_for_each_entry(route, &this->routes.list, list) {
+			hops[n] = rt_entry_next(vrr, route, dest);
+			pids[n] = route->path_id;
+			if (hops[n] && ++n == VRR_MULTIPATH_MAX)
+				break;
+		}
+	}
+	spin_unlock_irqrestore(&d->rt_lock, flags);
+
+	flow = &d->flows[jhash_2words(src, dest, 0) & (VRR_FLOW_SIZE - 1)];
+	spin_lock_irqsave(&d->flow_lock, flags);
+	if (flow->stamp && flow->src == src && flow->dst == dest &&
+	    time_before(now, flow->stamp + msecs_to_jiffies(VRR_FLOW_TIMEOUT)))
+		cached = flow->nh;
+	spin_unlock_irqrestore(&d->flow_lock, flags);
+
+	for (i = 0; i < n; i++) {
+		weight = pset_link_weight(vrr, hops[i]);
+		if (!weight)
+			continue;
+		if (cached && hops[i] == cached) {
+			best = cached;
+			best_pid = pids[i];
+			break;
+		}
+		score = (jhash_3words(src, dest, pids[i], 0) >> 16) * weight;
+		if (!best || score > best_score) {
+			best = hops[i];
+			best_pid = pids[i];
+			best_score = score;
+		}
+	}
+
+	if (path_id)
+		*path_id = best_pid;
+
+	/* No usable link, keep to the single path lookup */
+	if (!best)
+		return rt_get_next(vrr, dest);
+
+	rt_flow_note(vrr, dest, src, best);
+	return best;
+}
+
+/*
+ * Remembers that the flow from src to dest goes to nh.  Returns 1 if
+ * that is a new decision, 0 if the flow was already going there.
+ */
+int rt_flow_note(struct vrr_node *vrr, u32 dest, u32 src, u32 nh)
+{
+	struct vrr_data *d = vrr->data;
+	struct vrr_flow *flow;
+	unsigned long flags, now = jiffies;
+	int fresh;
+
+	flow = &d->flows[jhash_2words(src, dest, 0) & (VRR_FLOW_SIZE - 1)];
+	spin_lock_irqsave(&d->flow_lock, flags);
+	fresh = !(flow->stamp && flow->src == src && flow->dst == dest &&
+		  flow->nh == nh &&
+		  time_before(now, flow->stamp +
+			      msecs_to_jiffies(VRR_FLOW_TIMEOUT)));
+	flow->src = src;
+	flow->dst = dest;
+	flow->nh = nh;
+	flow->stamp = now ? now : 1;
+	spin_unlock_irqrestore(&d->flow_lock, flags);
+
+	return fresh;
+}
+
+rt_entry* route_list_search_rmv(struct vrr_node *vrr, rt_entry *r_list,
+				u32 endpoint, u32 path_id)
 {
 	rt_entry *tmp = NULL;
 	struct list_head *pos, *q;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_rt_lock, flags);
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
 
 	list_for_each_safe(pos, q, &r_list->list){
 		tmp = list_entry(pos, rt_entry, list);
 		if (tmp->path_id == path_id) {
 			list_del(&tmp->list);
-			spin_unlock_irqrestore(&vrr_rt_lock, flags);
+			hlist_del(&tmp->hnode);
+			spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
 			return tmp;
 		}
 	}
 
-	spin_unlock_irqrestore(&vrr_rt_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
 	return NULL;
 }
 
@@ -233,7 +431,8 @@ rt_entry* route_list_search_rmv(rt_entry *r_list, u32 endpoint, u32 path_id)
  * Adds a route to the rb tree.	 Might add two different entries if there
  * are both ea and eb values for the route.
  */
-int rt_add_route(u32 ea, u32 eb, u32 na, u32 nb, u32 path_id)
+int rt_add_route(struct vrr_node *vrr, u32 ea, u32 eb, u32 na, u32 nb,
+		 u32 path_id)
 {
 	rt_node_t *insert = NULL;
 	rt_entry *route = NULL;
@@ -244,11 +443,11 @@ int rt_add_route(u32 ea, u32 eb, u32 na, u32 nb, u32 path_id)
 	 * ea and pid */
 
 
-	spin_lock_irqsave(&vrr_rt_lock, flags);
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
 
 	if (ea) {
 		/* rt_insert_helper(&rt_root, new_entry, new_entry->ea); */
-		insert = rt_find_insert_node(&rt_root, ea);
+		insert = rt_find_insert_node(&vrr->data->rt_root, ea);
 		if (!insert)
 			goto out_err;
 		route = (rt_entry *) kmalloc(sizeof(rt_entry), GFP_ATOMIC);
@@ -260,9 +459,11 @@ int rt_add_route(u32 ea, u32 eb, u32 na, u32 nb, u32 path_id)
 		route->nb = nb;
 		route->path_id = path_id;
 		list_add(&(route->list), &(insert->routes.list));
+		hlist_add_head(&route->hnode,
+			       rt_label_head(vrr->data, path_id));
 	}
 	if (eb) {
-		insert = rt_find_insert_node(&rt_root, eb);
+		insert = rt_find_insert_node(&vrr->data->rt_root, eb);
 		if (!insert)
 			goto out_err;
 		route = (rt_entry *) kmalloc(sizeof(rt_entry), GFP_ATOMIC);
@@ -274,13 +475,15 @@ int rt_add_route(u32 ea, u32 eb, u32 na, u32 nb, u32 path_id)
 		route->nb = nb;
 		route->path_id = path_id;
 		list_add(&(route->list), &(insert->routes.list));
+		hlist_add_head(&route->hnode,
+			       rt_label_head(vrr->data, path_id));
 	}
 	goto out;
 
 out_err:
 	ret = 0;
 out:
-	spin_unlock_irqrestore(&vrr_rt_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
 	return ret;
 }
 
@@ -327,32 +530,144 @@ else {
 }
 
 
-int rt_remove_nexts(u_int route_hop_to_remove)	//TODO: code this
+int rt_remove_nexts(struct vrr_node *vrr, u_int route_hop_to_remove,
+		    struct list_head *removed)
 {
-	return 0;
+	struct rb_node *rb;
+	rt_node_t *this;
+	rt_entry *route, *tmp;
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
+
+	for (rb = rb_first(&vrr->data->rt_root); rb; rb = rb_next(rb)) {
+		this = rb_entry(rb, rt_node_t, node);
+		list_for_each_entry_safe(route, tmp, &this->routes.list, list) {
+			if (route->na != route_hop_to_remove &&
+			    route->nb != route_hop_to_remove)
+				continue;
+			list_del(&route->list);
+			hlist_del(&route->hnode);
+			/* Routes are stored under both endpoints, only
+			 * hand back the copy kept under ea. */
+			if (route->ea && this->endpoint != route->ea) {
+				kfree(route);
+				continue;
+			}
+			list_add_tail(&route->list, removed);
+			count++;
+		}
+	}
+
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
+	return count;
+}
+
+rt_entry* rt_remove_route(struct vrr_node *vrr, u32 ea, u32 path_id)
+{
+	return(rt_search_rmv(vrr, ea, path_id));
+}
+
+/* Must hold rt_lock */
+static rt_node_t *rt_find_node(struct rb_root *root, u32 endpoint)
+{
+	struct rb_node *node = root->rb_node;
+
+	while (node) {
+		rt_node_t *this = rb_entry(node, rt_node_t, node);
+
+		if (endpoint < this->endpoint)
+			node = node->rb_left;
+		else if (endpoint > this->endpoint)
+			node = node->rb_right;
+		else
+			return this;
+	}
+	return NULL;
 }
 
-rt_entry* rt_remove_route(u32 ea, u32 path_id)
+rt_entry *rt_remove_path(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id)
 {
-	return(rt_search_rmv(&rt_root, ea, path_id));
+	u32 ends[2] = { ea, eb };
+	rt_node_t *this;
+	rt_entry *route, *tmp, *found = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
+
+	for (i = 0; i < 2; i++) {
+		if (!ends[i] || !(this = rt_find_node(&vrr->data->rt_root,
+						       ends[i])))
+			continue;
+		list_for_each_entry_safe(route, tmp, &this->routes.list, list) {
+			if (route->ea != ea || route->eb != eb ||
+			    route->path_id != path_id)
+				continue;
+			list_del(&route->list);
+			hlist_del(&route->hnode);
+			if (!found)
+				found = route;
+			else
+				kfree(route);
+		}
+	}
+
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
+	return found;
+}
+
+int rt_replace_next(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+		    u32 old_hop, u32 new_hop)
+{
+	u32 ends[2] = { ea, eb };
+	rt_node_t *this;
+	rt_entry *route;
+	unsigned long flags;
+	int i, count = 0;
+
+	spin_lock_irqsave(&vrr->data->rt_lock, flags);
+
+	for (i = 0; i < 2; i++) {
+		if (!ends[i] || !(this = rt_find_node(&vrr->data->rt_root,
+						       ends[i])))
+			continue;
+		list_for_each_entry(route, &this->routes.list, list) {
+			if (route->ea != ea || route->eb != eb ||
+			    route->path_id != path_id)
+				continue;
+			if (route->na == old_hop) {
+				route->na = new_hop;
+				count++;
+			} else if (route->nb == old_hop) {
+				route->nb = new_hop;
+				count++;
+			}
+		}
+	}
+
+	spin_unlock_irqrestore(&vrr->data->rt_lock, flags);
+	return count;
 }
 
 /*
  * Physical set functions
  */
-int pset_add(u_int node, const unsigned char mac[MAC_ADDR_LEN], u_int status,
+int pset_add(struct vrr_node *vrr, u_int node,
+	     const unsigned char mac[MAC_ADDR_LEN], int ifindex, u_int status,
 	     u_int active)
 {
 	pset_list_t * tmp;
 	struct list_head * pos;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list){
+	list_for_each(pos, &vrr->data->pset.list){
 		tmp= list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return 0;
 		}
 	}
@@ -362,25 +677,38 @@ int pset_add(u_int node, const unsigned char mac[MAC_ADDR_LEN], u_int status,
 	tmp->node = node;
 	tmp->status = status;
 	tmp->active = active ? 1 : 0;
-	atomic_set(&tmp->fail_count, 0);
+	tmp->ifindex = ifindex;
+	tmp->last_heard = jiffies;
+	tmp->last_sent = 0;
+	tmp->hello_seq = 0;
+	tmp->hello_trans = 0;
+	tmp->hello_deltas = 0;
+	vrr_bucket_init(&tmp->ctl_bucket, VRR_CTL_NEIGH_BURST);
+	atomic_set(&tmp->tx_fail, 0);
+	tmp->repaired = 0;
+	tmp->n_links = 0;
+	tmp->rx_seq = 0;
+	tmp->rx_ratio = VRR_ETX_SCALE;
+	tmp->etx = VRR_ETX_SCALE;
+	tmp->load = 0;
 	memcpy(tmp->mac, mac, sizeof(mac_addr));
 
-	list_add(&(tmp->list), &(pset.list));
+	list_add(&(tmp->list), &(vrr->data->pset.list));
 
-	pset_size += 1;
+	vrr->data->pset_size += 1;
 
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return 1;
 }
 
-int pset_remove(u_int node)
+int pset_remove(struct vrr_node *vrr, u_int node)
 {
 	pset_list_t * tmp;
 	struct list_head * pos, *q;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each_safe(pos, q, &pset.list) {
+	list_for_each_safe(pos, q, &vrr->data->pset.list) {
 		tmp= list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
 			list_del(pos);
@@ -388,58 +716,63 @@ int pset_remove(u_int node)
 		}
 	}
 
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return 0;
 }
 
-u_int pset_get_status(u_int node)
+u_int pset_get_status(struct vrr_node *vrr, u_int node)
 {
 	pset_list_t * tmp;
 	struct list_head * pos;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list){
+	list_for_each(pos, &vrr->data->pset.list){
 		tmp= list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return tmp->status;
 		}
 	}
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return PSET_UNKNOWN;
 }
 
-int pset_update_status(u_int node, u_int newstatus, u_int active)
+int pset_update_status(struct vrr_node *vrr, u_int node, u_int newstatus,
+		       u_int active)
 {
 	pset_list_t * tmp;
 	struct list_head * pos;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list){
+	list_for_each(pos, &vrr->data->pset.list){
 		tmp= list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
 			tmp->status = newstatus;
 			tmp->active = active ? 1 : 0;
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+			if (newstatus != PSET_FAILED) {
+				atomic_set(&tmp->tx_fail, 0);
+				tmp->repaired = 0;
+			}
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return 1;
 		}
 	}
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return 0;
 }
 
-int pset_lookup_mac(mac_addr mac, u32 *node)
+int pset_lookup_mac(struct vrr_node *vrr, mac_addr mac, u32 *node)
 {
 	pset_list_t *tmp;
 	struct list_head *pos;
 	unsigned long flags;
 	int ret = 0;
 
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list) {
+	list_for_each(pos, &vrr->data->pset.list) {
 		tmp = list_entry(pos, pset_list_t, list);
 		if (!memcmp(mac, tmp->mac, ETH_ALEN)) {
 			*node = tmp->node;
@@ -449,19 +782,19 @@ int pset_lookup_mac(mac_addr mac, u32 *node)
 	}
 
 out:
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return ret;
 }
 
-int pset_get_active(u32 node)
+int pset_get_active(struct vrr_node *vrr, u32 node)
 {
 	pset_list_t *tmp;
 	struct list_head *pos;
 	unsigned long flags;
 	int ret = 0;
 
-	spin_lock_irqsave(&vrr_pset_lock, flags);
-	list_for_each(pos, &pset.list) {
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
 		tmp = list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
 			ret = tmp->active;
@@ -469,136 +802,319 @@ int pset_get_active(u32 node)
 		}
 	}
 out:
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return ret;
 }
 
-int pset_get_mac(u_int node, mac_addr mac)
+int pset_get_mac(struct vrr_node *vrr, u_int node, mac_addr mac)
 {
 	pset_list_t * tmp;
 	struct list_head * pos;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list){
+	list_for_each(pos, &vrr->data->pset.list){
 		tmp= list_entry(pos, pset_list_t, list);
 		if (tmp->node == node) {
 			memcpy(mac, tmp->mac, sizeof(mac_addr));
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return 1;
 		}
 	}
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return 0;
 }
 
-int pset_inc_fail_count(struct pset_list *node)
+/* Number of VRR_HPKT_DELAY periods since node was last heard */
+int pset_fail_count(struct pset_list *node)
 {
-	VRR_DBG("Incrementing fail count for %x", node->node);
-	atomic_inc(&node->fail_count);
-	return atomic_read(&node->fail_count);
+	return (jiffies - node->last_heard) /
+		msecs_to_jiffies(VRR_HPKT_DELAY);
 }
 
-int pset_reset_fail_count(u32 node)
+int pset_reset_fail_count(struct vrr_node *vrr, const mac_addr mac)
 {
 	pset_list_t *tmp;
 	struct list_head *pos;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_pset_lock, flags);
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
 
-	list_for_each(pos, &pset.list) {
+	list_for_each(pos, &vrr->data->pset.list) {
 		tmp = list_entry(pos, pset_list_t, list);
-		if (tmp->node == node) {
-			VRR_DBG("Resetting fail count for %x", node);
-			atomic_set(&tmp->fail_count, 0);
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+		if (!memcmp(mac, tmp->mac, ETH_ALEN)) {
+			tmp->last_heard = jiffies;
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return 0;
 		}
 	}
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 	return -1;
 }
 
-struct list_head *pset_head()
+struct list_head *pset_head(struct vrr_node *vrr)
 {
-	return &pset.list;
+	return &vrr->data->pset.list;
 }
 
-int pset_get_proxy(u32 *proxy) {
-	u_int active[VRR_PSET_SIZE];
-	u_int i = 0, r;
-	pset_list_t *tmp;
-	struct list_head *pos;
-	unsigned long flags;
+void pset_lock(struct vrr_node *vrr, unsigned long *flags)
+{
+	spin_lock_irqsave(&vrr->data->pset_lock, *flags);
+}
 
-	spin_lock_irqsave(&vrr_pset_lock, flags);
-	list_for_each(pos, &pset.list) {
-		tmp = list_entry(pos, pset_list_t, list);
-		if (tmp->status == PSET_LINKED && tmp->active) {
-			active[i++] = tmp->node;
+void pset_unlock(struct vrr_node *vrr, unsigned long flags)
+{
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+}
+
+/* The next hop of the route we already have toward target is taken
+ * if it qualifies. Otherwise the neighbor whose id is closest to
+ * target on the ring, so that the request starts off in the right
+ * direction; ties are broken at random to spread the load. Neighbors
+ * over a poor link are only used when nothing else is left. */
+int pset_get_proxy(struct vrr_node *vrr, u32 target, u32 avoid, u32 *proxy)
+{
+	struct pset_state *pstate = vrr->pstate;
+	u32 active[VRR_PSET_SIZE], best[VRR_PSET_SIZE];
+	int etxs[VRR_PSET_SIZE];
+	u32 nh, diff, best_diff = UINT_MAX, weak = 0;
+	int i, j, n, nbest = 0, avoided = 0, etx, weak_etx = INT_MAX;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&pstate->lock);
+		n = min(pstate->la_size, VRR_PSET_SIZE);
+		memcpy(active, pstate->l_active, n * sizeof(u32));
+		for (i = 0; i < n; i++) {
+			j = pset_state_find(pstate, active[i]);
+			etxs[i] = j < 0 ? VRR_ETX_SCALE : pstate->link_etx[j];
+		}
+	} while (read_seqretry(&pstate->lock, seq));
+
+	nh = rt_get_next(vrr, target);
+	for (i = 0; i < n; i++) {
+		if (avoid && active[i] == avoid) {
+			avoided = 1;
+			continue;
+		}
+		etx = etxs[i];
+		if (etx > VRR_ETX_POOR) {
+			if (etx < weak_etx) {
+				weak = active[i];
+				weak_etx = etx;
+			}
+			continue;
 		}
+		if (nh && active[i] == nh) {
+			*proxy = nh;
+			return 1;
+		}
+		diff = get_diff(active[i], target);
+		if (diff < best_diff) {
+			best_diff = diff;
+			nbest = 0;
+		}
+		if (diff == best_diff)
+			best[nbest++] = active[i];
 	}
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
 
-	if (!i)
-		return 0;
+	if (!nbest) {
+		if (weak_etx != INT_MAX) {
+			*proxy = weak;
+			return 1;
+		}
+		if (!avoided)
+			return 0;
+		*proxy = avoid;
+		return 1;
+	}
 
-	get_random_bytes(&r, 4);
-	r = r % i;
-	*proxy = active[r];
+	*proxy = best[net_random() % nbest];
 	return 1;
 }
 
-int pset_contains(u32 id)
+int pset_contains(struct vrr_node *vrr, u32 id)
 {
 	pset_list_t *tmp;
 	unsigned long flags;
 	struct list_head *pos;
 
-	spin_lock_irqsave(&vrr_pset_lock, flags);
-	list_for_each(pos, &pset.list) {
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
 		tmp = list_entry(pos, pset_list_t, list);
 		if (tmp->node == id) {
-			spin_unlock_irqrestore(&vrr_pset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 			return 1;
 		}
 	}
 
-	spin_unlock_irqrestore(&vrr_pset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
 
 	return 0;
 }
 
+int pset_fail_ifindex(struct vrr_node *vrr, int ifindex)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->ifindex == ifindex && tmp->status != PSET_FAILED) {
+			VRR_DBG("Link down, marking failed node: %x", tmp->node);
+			tmp->status = PSET_FAILED;
+			pset_state_link(vrr, tmp);
+			count++;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+
+	return count;
+}
+
+int pset_expire(struct vrr_node *vrr)
+{
+	pset_list_t *tmp;
+	struct list_head *pos, *q;
+	unsigned long flags;
+	int count, failed = 0;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each_safe(pos, q, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		count = pset_fail_count(tmp);
+		if ((count >= VRR_FAIL_TIMEOUT || tmp->etx > VRR_ETX_FAIL) &&
+		    tmp->status != PSET_FAILED) {
+			VRR_DBG("Marking failed node: %x", tmp->node);
+			tmp->status = PSET_FAILED;
+			failed++;
+		}
+		if (count >= 2 * VRR_FAIL_TIMEOUT) {
+			VRR_DBG("Deleting failed node: %x", tmp->node);
+			list_del(pos);
+			kfree(tmp);
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+
+	return failed;
+}
+
+int pset_tx_status(struct vrr_node *vrr, const mac_addr mac, int sent,
+		   int busy)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret = 0, weight;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (memcmp(mac, tmp->mac, ETH_ALEN))
+			continue;
+		weight = pset_weight(tmp);
+		if (busy)
+			tmp->load += (VRR_LOAD_SCALE - tmp->load +
+				      VRR_LOAD_WEIGHT - 1) / VRR_LOAD_WEIGHT;
+		else
+			tmp->load -= (tmp->load + VRR_LOAD_WEIGHT - 1) /
+				VRR_LOAD_WEIGHT;
+		if (sent > 0) {
+			atomic_set(&tmp->tx_fail, 0);
+			tmp->last_sent = jiffies;
+		} else if (sent < 0 &&
+			   atomic_inc_return(&tmp->tx_fail) >= VRR_TX_FAIL_LIMIT &&
+			 tmp->status != PSET_FAILED) {
+			VRR_DBG("Transmit failures, marking failed node: %x",
+				tmp->node);
+			tmp->status = PSET_FAILED;
+			ret = 1;
+		}
+		/* Keep pset state writes off most frames */
+		if (pset_weight(tmp) != weight)
+			pset_state_link(vrr, tmp);
+		break;
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+
+	return ret;
+}
+
+int pset_take_failed(struct vrr_node *vrr, u32 *nodes, int max)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int i = 0;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (i == max)
+			break;
+		if (tmp->status == PSET_FAILED && !tmp->repaired) {
+			tmp->repaired = 1;
+			nodes[i++] = tmp->node;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+
+	return i;
+}
+
+int pset_get_ifindex(struct vrr_node *vrr, const mac_addr mac)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (!memcmp(mac, tmp->mac, ETH_ALEN)) {
+			ret = tmp->ifindex;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+
+	return ret;
+}
+
 /*
  * Virtual set functions
  */
-int vset_add(u32 node, u32 *rem)
+int vset_add(struct vrr_node *vrr, u32 node, u32 *rem)
 {
 	vset_list_t *tmp;
 	struct list_head *pos;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_vset_lock, flags);
+	spin_lock_irqsave(&vrr->data->vset_lock, flags);
 
-	list_for_each(pos, &vset.list) {
+	list_for_each(pos, &vrr->data->vset.list) {
 		tmp = list_entry(pos, vset_list_t, list);
 		if (tmp->node == node)
 			goto out_err;
 	}
 
-	insert_vset_node(node);
-	if (!vset_bump(rem))
+	insert_vset_node(vrr, node);
+	if (!vset_bump(vrr, rem))
 		goto out_nobump;
 
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 	return 1;
 
 out_nobump:
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 	return 0;
 
 out_err:
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 	return -1;
 }
 
@@ -611,11 +1127,12 @@ int cmp_diff(const void *a, const void *b)
 	return 0;
 }
 
-int vset_bump(u32 *rem) {
+int vset_bump(struct vrr_node *vrr, u32 *rem) {
 	vset_list_t *tmp;
 	struct list_head *pos, *q;
 	int radius = VRR_VSET_SIZE / 2;
 	int i = 0;
+	int vset_size = vrr->data->vset_size;
 	u32 left[vset_size], right[vset_size];
 
 	VRR_DBG("vset_size: %x", vset_size);
@@ -623,7 +1140,7 @@ int vset_bump(u32 *rem) {
 		return 0;
 
 	/* Fill arrays with diffs in both directions */
-	list_for_each(pos, &vset.list) {
+	list_for_each(pos, &vrr->data->vset.list) {
 		tmp = list_entry(pos, vset_list_t, list);
 		left[i] = tmp->diff_left;
 		right[i++] = tmp->diff_right;
@@ -634,7 +1151,7 @@ int vset_bump(u32 *rem) {
 	sort(right, vset_size, sizeof(u32), &cmp_diff, NULL);
 
 	/* Bump the node with left[radius] and right[radius] */
-	list_for_each_safe(pos, q, &vset.list) {
+	list_for_each_safe(pos, q, &vrr->data->vset.list) {
 		tmp = list_entry(pos, vset_list_t, list);
 		if (tmp->diff_left == left[radius] &&
 		    tmp->diff_right == right[radius]) {
@@ -649,40 +1166,42 @@ int vset_bump(u32 *rem) {
 	return -1;
 }
 
-int vset_should_add(u32 node)
+int vset_should_add(struct vrr_node *vrr, u32 node)
 {
 	vset_list_t *tmp;
 	struct list_head *pos;
+	u_int me = vrr->id;
+	int vset_size = vrr->data->vset_size;
 	u32 left[vset_size], right[vset_size];
-	u32 diff_left = (node > ME) ?
-		UINT_MAX - get_diff(node, ME) : get_diff(node, ME);
-	u32 diff_right = (node < ME) ?
-		UINT_MAX - get_diff(node, ME) : get_diff(node, ME);
+	u32 diff_left = (node > me) ?
+		UINT_MAX - get_diff(node, me) : get_diff(node, me);
+	u32 diff_right = (node < me) ?
+		UINT_MAX - get_diff(node, me) : get_diff(node, me);
 	int radius = VRR_VSET_SIZE / 2;
 	int i = 0;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_vset_lock, flags);
+	spin_lock_irqsave(&vrr->data->vset_lock, flags);
 
-	list_for_each(pos, &vset.list) {
+	list_for_each(pos, &vrr->data->vset.list) {
 		tmp = list_entry(pos, vset_list_t, list);
 		if (tmp->node == node) {
-			spin_unlock_irqrestore(&vrr_vset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 			return 0;
 		}
 	}
 
 	if (vset_size < VRR_VSET_SIZE) {
-		spin_unlock_irqrestore(&vrr_vset_lock, flags);
+		spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 		return 1;
 	}
 
-	list_for_each(pos, &vset.list) {
+	list_for_each(pos, &vrr->data->vset.list) {
 		tmp = list_entry(pos, vset_list_t, list);
 		left[i] = tmp->diff_left;
 		right[i++] = tmp->diff_right;
 	}
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 
 	sort(left, vset_size, sizeof(u32), &cmp_diff, NULL);
 	sort(right, vset_size, sizeof(u32), &cmp_diff, NULL);
@@ -696,24 +1215,24 @@ int vset_should_add(u32 node)
 	return 0;
 }
 
-int vset_remove(u_int node)
+int vset_remove(struct vrr_node *vrr, u_int node)
 {
 	vset_list_t * tmp;
 	struct list_head * pos, *q;
 	unsigned long flags;
-	spin_lock_irqsave(&vrr_vset_lock, flags);
+	spin_lock_irqsave(&vrr->data->vset_lock, flags);
 
-	list_for_each_safe(pos, q, &vset.list) {
+	list_for_each_safe(pos, q, &vrr->data->vset.list) {
 		tmp= list_entry(pos, vset_list_t, list);
 		if (tmp->node == node) {
 			list_del(pos);
 			kfree(tmp);
-			spin_unlock_irqrestore(&vrr_vset_lock, flags);
+			spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 			return 1;
 		}
 	}
 
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 	return 0;
 }
 
@@ -722,7 +1241,7 @@ int vset_remove(u_int node)
 // int current_vset_size;
 // u_int * vset_all = NULL;
 // current_vset_size = vset_get_all(vset_all);
-int vset_get_all(u_int **vset_all)
+int vset_get_all(struct vrr_node *vrr, u_int **vset_all)
 {
 	vset_list_t *tmp;
 	struct list_head *pos;
@@ -730,17 +1249,17 @@ int vset_get_all(u_int **vset_all)
 	int l_vset_size;
 	unsigned long flags;
 
-	spin_lock_irqsave(&vrr_vset_lock, flags);
-	l_vset_size = vset_size;
+	spin_lock_irqsave(&vrr->data->vset_lock, flags);
+	l_vset_size = vrr->data->vset_size;
 
 	VRR_DBG("l_vset_size: %x", l_vset_size);
 	*vset_all = (u_int *) kmalloc(l_vset_size * sizeof(u_int), GFP_ATOMIC);
 
-	list_for_each(pos, &vset.list){
+	list_for_each(pos, &vrr->data->vset.list){
 		tmp = list_entry(pos, vset_list_t, list);
 		(*vset_all)[i++] = tmp->node;
 	}
-	spin_unlock_irqrestore(&vrr_vset_lock, flags);
+	spin_unlock_irqrestore(&vrr->data->vset_lock, flags);
 	return l_vset_size;
 }
 
@@ -754,15 +1273,261 @@ u_int get_diff(u_int x, u_int y)
 	return j;
 }
 
-void insert_vset_node(u_int node)
+void insert_vset_node(struct vrr_node *vrr, u_int node)
 {
 	vset_list_t * tmp;
+	u_int me = vrr->id;
 	tmp = (vset_list_t *) kmalloc(sizeof(vset_list_t), GFP_ATOMIC);
 	tmp->node = node;
-	tmp->diff_left = (node > ME) ?
-		UINT_MAX - get_diff(node, ME) : get_diff(node, ME);
-	tmp->diff_right = (node < ME) ?
-		UINT_MAX - get_diff(node, ME) : get_diff(node, ME);
-	list_add(&(tmp->list), &(vset.list));
-	vset_size++;
+	tmp->diff_left = (node > me) ?
+		UINT_MAX - get_diff(node, me) : get_diff(node, me);
+	tmp->diff_right = (node < me) ?
+		UINT_MAX - get_diff(node, me) : get_diff(node, me);
+	list_add(&(tmp->list), &(vrr->data->vset.list));
+	vrr->data->vset_size++;
+}
+
+void pset_set_hello(struct vrr_node *vrr, u32 node, u32 seq, int trans,
+		    int deltas)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->node == node) {
+			tmp->hello_seq = seq;
+			tmp->hello_trans = trans;
+			tmp->hello_deltas = deltas;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+}
+
+int pset_get_hello(struct vrr_node *vrr, u32 node, u32 *seq, int *trans)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret = -1;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->node == node) {
+			if (tmp->hello_deltas) {
+				*seq = tmp->hello_seq;
+				*trans = tmp->hello_trans;
+				ret = 0;
+			}
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+	return ret;
+}
+
+int pset_hello_quiet(struct vrr_node *vrr, unsigned long since)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	ret = !list_empty(&vrr->data->pset.list);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->status != PSET_LINKED || !tmp->hello_deltas ||
+		    !time_after(tmp->last_sent, since)) {
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+	return ret;
+}
+
+int pset_hello_deltas(struct vrr_node *vrr)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret = 1;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (!tmp->hello_deltas && tmp->status != PSET_FAILED) {
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+	return ret;
+}
+
+int pset_ctl_admit(struct vrr_node *vrr, const mac_addr mac)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int ret = 1;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (!memcmp(mac, tmp->mac, ETH_ALEN)) {
+			ret = vrr_bucket_take(&tmp->ctl_bucket,
+					      VRR_CTL_NEIGH_RATE,
+					      VRR_CTL_NEIGH_BURST);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+	return ret;
+}
+
+void pset_set_links(struct vrr_node *vrr, u32 node, const u32 *links, int n)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+
+	n = min(n, 2 * VRR_PSET_SIZE);
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->node == node) {
+			memcpy(tmp->links, links, n * sizeof(u32));
+			tmp->n_links = n;
+			pset_state_link(vrr, tmp);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+}
+
+/* The relay over the best link among those that qualify, from the
+ * snapshot of pset_state_update so that it can run per frame */
+int pset_find_relay(struct vrr_node *vrr, u32 target, u32 avoid, u32 *relay)
+{
+	struct pset_state *pstate = vrr->pstate;
+	u32 best;
+	int i, j, n, best_weight;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&pstate->lock);
+		best = 0;
+		best_weight = 0;
+		for (i = 0; i < pstate->link_size; i++) {
+			if (pstate->link_id[i] == target ||
+			    pstate->link_id[i] == avoid ||
+			    pstate->link_weight[i] <= best_weight)
+				continue;
+			n = min(pstate->link_nlinks[i], 2 * VRR_PSET_SIZE);
+			for (j = 0; j < n; j++)
+				if (pstate->link_links[i][j] == target)
+					break;
+			if (j < n) {
+				best = pstate->link_id[i];
+				best_weight = pstate->link_weight[i];
+			}
+		}
+	} while (read_seqretry(&pstate->lock, seq));
+
+	if (!best)
+		return 0;
+	*relay = best;
+	return 1;
+}
+
+/* Weight of the link to node when spreading flows over paths: 0 if it
+ * isn't linked, less the higher its ETX and load and for every
+ * transmission to it that just failed. Call with the pset lock held. */
+int pset_weight(struct pset_list *node)
+{
+	if (node->status != PSET_LINKED)
+		return 0;
+	return max(1, (VRR_TX_FAIL_LIMIT - atomic_read(&node->tx_fail)) *
+		   16 * VRR_ETX_SCALE / node->etx *
+		   (VRR_LOAD_SCALE - node->load) / VRR_LOAD_SCALE);
+}
+
+/* pset_weight of node as last published to the pset state, looked up
+ * without the pset lock */
+int pset_link_weight(struct vrr_node *vrr, u32 node)
+{
+	struct pset_state *pstate = vrr->pstate;
+	int i, weight;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&pstate->lock);
+		i = pset_state_find(pstate, node);
+		weight = i < 0 ? 0 : pstate->link_weight[i];
+	} while (read_seqretry(&pstate->lock, seq));
+
+	return weight;
+}
+
+/* Hello seqs count up by one for every hello a node sends, full or
+ * delta, so a gap is the number of its hellos we missed. The delivery
+ * ratio is a moving average over hellos. Only the reverse direction is
+ * measured; ETX takes the link to be symmetric. */
+void pset_hello_rx(struct vrr_node *vrr, u32 node, u32 seq)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	u32 lost = 0;
+	int r;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->node != node)
+			continue;
+		if (seq == tmp->rx_seq)
+			break;
+		if (tmp->rx_seq && seq - tmp->rx_seq - 1 < VRR_ETX_GAP_MAX)
+			lost = seq - tmp->rx_seq - 1;
+		tmp->rx_seq = seq;
+
+		r = tmp->rx_ratio;
+		while (lost--)
+			r -= (r + VRR_ETX_WEIGHT - 1) / VRR_ETX_WEIGHT;
+		r += (VRR_ETX_SCALE - r + VRR_ETX_WEIGHT - 1) / VRR_ETX_WEIGHT;
+		tmp->rx_ratio = r = max(r, 1);
+
+		tmp->etx = min(2 * VRR_ETX_FAIL, VRR_ETX_SCALE * VRR_ETX_SCALE /
+			       r * VRR_ETX_SCALE / r);
+		pset_state_link(vrr, tmp);
+		break;
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+}
+
+int pset_get_etx(struct vrr_node *vrr, u32 node)
+{
+	pset_list_t *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	int etx = VRR_ETX_SCALE;
+
+	spin_lock_irqsave(&vrr->data->pset_lock, flags);
+	list_for_each(pos, &vrr->data->pset.list) {
+		tmp = list_entry(pos, pset_list_t, list);
+		if (tmp->node == node) {
+			etx = tmp->etx;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vrr->data->pset_lock, flags);
+	return etx;
 }
@@ -3,6 +3,8 @@
 
 #include <linux/types.h>
 
+struct vrr_node;
+
 #define PSET_LINKED	0
 #define PSET_PENDING	1
 #define PSET_FAILED	2
@@ -16,6 +18,7 @@ typedef struct routing_table_entry {
 	u32 nb;		//next B
 	int path_id;		//Path ID
 	struct list_head list;
+	struct hlist_node hnode;	//in the path id hash
 } rt_entry;
 
 //Physical Set Setup
@@ -25,28 +28,67 @@ typedef struct pset_list {
 	u_int			status;
         u_int			active;
 	mac_addr		mac;
-        atomic_t		fail_count;
+	int			ifindex;	//interface it was heard on
+	unsigned long		last_heard;	//jiffies, any frame
+	unsigned long		last_sent;	//jiffies, unicast frame
+	u32			hello_seq;	//seq of its last full hello
+	int			hello_trans;	//our place in that hello
+	int			hello_deltas;	//sends delta hellos
+	struct vrr_bucket	ctl_bucket;	//setup frames it may send us
+	atomic_t		tx_fail;	//consecutive transmit failures
+	int			repaired;	//routes through it torn down
+	u32			links[2 * VRR_PSET_SIZE]; //its linked nodes
+	int			n_links;	//as of its last full hello
+	u32			rx_seq;		//seq of its last hello heard
+	int			rx_ratio;	//of its hellos heard, ETX_SCALE
+	int			etx;		//ETX_SCALE for a perfect link
+	int			load;		//busy tx queue, LOAD_SCALE
 } pset_list_t;
 
 /*
  * Routes, Pset, and Vset initialization
- * vrr_data_init : Call once before using any of the other functions
+ * vrr_data_init : Call once per node before using any of the other
+ *	functions.  Returns 0 on success, -ENOMEM on failure
+ * vrr_data_exit : Free all routes, pset and vset entries of the node
  */
-void vrr_data_init(void);
+int vrr_data_init(struct vrr_node *vrr);
+void vrr_data_exit(struct vrr_node *vrr);
 
 
 /* Routing Table functions:
  * rt_get_next : Get next closest hop given destination as parameter.
+ * rt_get_next_flow : Get the next hop toward dest for the flow from src,
+ *	spreading flows over every route to dest.  path_id gets the route
+ *	taken, 0 if none, and may be NULL
+ * rt_flow_note : Remember that the flow from src to dest goes to nh.
+ *	Returns 1 if that is new for the flow, 0 otherwise
+ * rt_get_next_label : Get the next hop toward endpoint on the route with
+ *	the given path_id, by hash on the path id and the next hop, without
+ *	walking the tree or the pset.  Returns 0 if there is no such route
+ *	or its next hop can't be used
  * rt_add_route : Adds a route to the Routing Table.
- * rt_remove_nexts : Given a 'NextA' hop, remove all entries in the table
- *	that use that node
+ * rt_remove_nexts : Given a next hop, remove all entries in the table
+ *	that use that node as 'NextA' or 'NextB', moving one copy of each
+ *	onto the passed list.  Returns the number of entries removed
  * rt_remove_route : deletes a route form the Routing Table.
+ * rt_remove_path : Remove both copies of the route <ea, eb, path_id>.
+ *	Returns the copy kept under ea, or NULL if there is none
+ * rt_replace_next : Use new_hop instead of old_hop as next hop of the
+ *	route <ea, eb, path_id>.  Returns the number of entries changed
  */
-u_int rt_get_next(u_int dest);
-u_int rt_get_next_exclude(u_int dest, u_int src);
-int rt_add_route(u32 ea, u32 eb, u32 na, u32 nb, u32 path_id);
-int rt_remove_nexts(u_int route_hop_to_remove);
-rt_entry* rt_remove_route(u32 ea, u32 path_id);
+u_int rt_get_next(struct vrr_node *vrr, u_int dest);
+u_int rt_get_next_exclude(struct vrr_node *vrr, u_int dest, u_int src);
+u32 rt_get_next_flow(struct vrr_node *vrr, u32 dest, u32 src, u32 *path_id);
+int rt_flow_note(struct vrr_node *vrr, u32 dest, u32 src, u32 nh);
+u32 rt_get_next_label(struct vrr_node *vrr, u32 endpoint, u32 path_id);
+int rt_add_route(struct vrr_node *vrr, u32 ea, u32 eb, u32 na, u32 nb,
+		 u32 path_id);
+int rt_remove_nexts(struct vrr_node *vrr, u_int route_hop_to_remove,
+		    struct list_head *removed);
+rt_entry* rt_remove_route(struct vrr_node *vrr, u32 ea, u32 path_id);
+rt_entry *rt_remove_path(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id);
+int rt_replace_next(struct vrr_node *vrr, u32 ea, u32 eb, u32 path_id,
+		    u32 old_hop, u32 new_hop);
 
 /* Functions for physical set of nodes, and also their current state (linked, active or pending)
  * pset_add : Add a node to the physical set.  Returns 1 on success,
@@ -58,19 +100,80 @@ rt_entry* rt_remove_route(u32 ea, u32 path_id);
  * pset_get_mac: Gets current status of physical node.  Uses the passed pointer
  *	to mac for the data.  Returns 1 on success, 0 on failure.
  * pset_update_status : Updates node with a new status.
+ * pset_fail_ifindex : Mark every node heard on an interface failed.  Returns
+ *	the number of nodes newly failed
+ * pset_expire : Mark nodes not heard from for VRR_FAIL_TIMEOUT hellos, or
+ *	over a lossy link, failed and delete those not heard from for twice
+ *	as long.  Returns the number of nodes newly failed
+ * pset_lock : Hold the pset while walking pset_head
+ * pset_tx_status : Account a unicast transmission to mac, and whether its
+ *	queue was busy.  sent is 1 if it went out, 0 if it was dropped by
+ *	a full queue and -1 if the device failed it.  Returns 1 if the node
+ *	was just marked failed after repeated device failures
+ * pset_take_failed : Copy up to max failed nodes whose routes have not been
+ *	torn down yet into nodes, and mark them as handled.  Returns the count
+ * pset_get_ifindex : Interface a node with the given mac was heard on, or 0
+ * pset_reset_fail_count : Any frame from mac shows the node is alive
+ * pset_set_hello : Remember the seq of a full hello from node and the
+ *	transition it gave us, or that node doesn't send delta hellos
+ * pset_get_hello : Get what pset_set_hello stored.  Returns 0 if node sends
+ *	delta hellos, -1 otherwise
+ * pset_hello_quiet : Returns 1 if every node is linked, sends delta hellos
+ *	and got a unicast frame from us after since
+ * pset_hello_deltas : Returns 1 if every node sends delta hellos
+ * pset_get_proxy : Pick the linked active node to send a setup_req for
+ *	target through, other than avoid unless it is the only one.  Returns 1
+ *	on success, 0 if there is none
+ * pset_ctl_admit : Take a token from the control bucket of the node with
+ *	the given mac.  Returns 0 if it is empty, 1 otherwise or for unknown
+ *	nodes
+ * pset_set_links : Remember the linked nodes listed in a full hello from
+ *	node
+ * pset_find_relay : Pick the linked node over the heaviest link, other than
+ *	avoid, that is linked to target itself.  Returns 1 on success, 0 if
+ *	there is none.  Takes no lock
+ * pset_weight : Weight of the link to a node for multipath forwarding, 0 if
+ *	it can't be used.  Call with the pset lock held
+ * pset_link_weight : pset_weight of node as last published to the pset
+ *	state.  Takes no lock
+ * pset_hello_rx : Account a hello with the given seq from node in its
+ *	delivery ratio and ETX
+ * pset_get_etx : ETX of the link to node, VRR_ETX_SCALE if it is unknown
  */
-int pset_add(u_int node, const mac_addr mac, u_int status, u_int active);
-int pset_remove(u_int node);
-u_int pset_get_status(u_int node);
-int pset_lookup_mac(mac_addr mac, u32 *node);
-int pset_get_mac(u_int node, mac_addr mac);
-int pset_get_active(u32 node);
-int pset_update_status(u_int node, u_int new_status, u_int active);
-int pset_inc_fail_count(struct pset_list *node);
-int pset_reset_fail_count(u_int node);
-struct list_head *pset_head(void);
-int pset_get_proxy(u32 *proxy);
-int pset_contains(u32 id);
+int pset_add(struct vrr_node *vrr, u_int node, const mac_addr mac,
+	     int ifindex, u_int status, u_int active);
+int pset_remove(struct vrr_node *vrr, u_int node);
+u_int pset_get_status(struct vrr_node *vrr, u_int node);
+int pset_lookup_mac(struct vrr_node *vrr, mac_addr mac, u32 *node);
+int pset_get_mac(struct vrr_node *vrr, u_int node, mac_addr mac);
+int pset_get_active(struct vrr_node *vrr, u32 node);
+int pset_update_status(struct vrr_node *vrr, u_int node, u_int new_status,
+		       u_int active);
+int pset_fail_count(struct pset_list *node);
+int pset_reset_fail_count(struct vrr_node *vrr, const mac_addr mac);
+struct list_head *pset_head(struct vrr_node *vrr);
+void pset_lock(struct vrr_node *vrr, unsigned long *flags);
+void pset_unlock(struct vrr_node *vrr, unsigned long flags);
+int pset_get_proxy(struct vrr_node *vrr, u32 target, u32 avoid, u32 *proxy);
+int pset_contains(struct vrr_node *vrr, u32 id);
+int pset_fail_ifindex(struct vrr_node *vrr, int ifindex);
+int pset_expire(struct vrr_node *vrr);
+int pset_tx_status(struct vrr_node *vrr, const mac_addr mac, int sent,
+		   int busy);
+int pset_take_failed(struct vrr_node *vrr, u32 *nodes, int max);
+int pset_get_ifindex(struct vrr_node *vrr, const mac_addr mac);
+void pset_set_hello(struct vrr_node *vrr, u32 node, u32 seq, int trans,
+		    int deltas);
+int pset_get_hello(struct vrr_node *vrr, u32 node, u32 *seq, int *trans);
+int pset_hello_quiet(struct vrr_node *vrr, unsigned long since);
+int pset_hello_deltas(struct vrr_node *vrr);
+int pset_ctl_admit(struct vrr_node *vrr, const mac_addr mac);
+void pset_set_links(struct vrr_node *vrr, u32 node, const u32 *links, int n);
+int pset_find_relay(struct vrr_node *vrr, u32 target, u32 avoid, u32 *relay);
+int pset_weight(struct pset_list *node);
+int pset_link_weight(struct vrr_node *vrr, u32 node);
+void pset_hello_rx(struct vrr_node *vrr, u32 node, u32 seq);
+int pset_get_etx(struct vrr_node *vrr, u32 node);
 
 /* Functions for virtual set of nodes
  * vset_add : Adds a node to the virtual set.  Returns 0 on failure
@@ -79,9 +182,9 @@ int pset_contains(u32 id);
  * vset_get_all : pass in an array of size of the vset, and this function will
  *	populate it with all the vset nodes.  Returns the size of the array.
  */
-int vset_add(u32 node, u32 *rem);
-int vset_should_add(u32 node);
-int vset_remove(u_int node);
-int vset_get_all(u_int **vset_all);
+int vset_add(struct vrr_node *vrr, u32 node, u32 *rem);
+int vset_should_add(struct vrr_node *vrr, u32 node);
+int vset_remove(struct vrr_node *vrr, u_int node);
+int vset_get_all(struct vrr_node *vrr, u_int **vset_all);
 
 #endif	/* _VRR_DATA_H */
@@ -0,0 +1,285 @@
+/*
+ * VRR		An implementation of the VRR routing protocol.
+ *
+ *		Interface management. A netdevice notifier attaches and
+ *		detaches interfaces to the VRR node of their namespace as
+ *		they register, go up or down, change carrier or MTU or go
+ *		away.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/if_arp.h>
+#include <linux/notifier.h>
+#include <linux/rtnetlink.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include "vrr.h"
+#include "vrr_data.h"
+
+/* Default enable list for new nodes. Empty means every ethernet
+ * interface except lo and eth0. */
+static char *ifaces = "";
+module_param(ifaces, charp, 0444);
+MODULE_PARM_DESC(ifaces, "Space or comma separated interfaces to run VRR on");
+
+/* Parse an enable list into the node. The enable list is protected
+ * by the rtnl lock, like the notifier that reads it. */
+static int vrr_dev_parse(struct vrr_node *vrr, const char *names)
+{
+	char buf[VRR_MAX_IFACES * (IFNAMSIZ + 1)];
+	char list[VRR_MAX_IFACES][IFNAMSIZ];
+	char *p = buf, *name;
+	int i, n = 0;
+
+	strlcpy(buf, names, sizeof(buf));
+	while ((name = strsep(&p, " ,\n")) != NULL) {
+		if (!*name)
+			continue;
+		if (n == VRR_MAX_IFACES || strlen(name) >= IFNAMSIZ)
+			return -EINVAL;
+		strlcpy(list[n++], name, IFNAMSIZ);
+	}
+
+	for (i = 0; i < n; i++)
+		strlcpy(vrr->ifaces[i], list[i], IFNAMSIZ);
+	vrr->n_ifaces = n;
+	return 0;
+}
+
+static int vrr_dev_enabled(struct vrr_node *vrr, struct net_device *dev)
+{
+	int i;
+
+	if (dev->flags & IFF_LOOPBACK || dev->type != ARPHRD_ETHER)
+		return 0;
+
+	if (!vrr->n_ifaces)
+		return strcmp(dev->name, "eth0") != 0;
+
+	for (i = 0; i < vrr->n_ifaces; i++)
+		if (!strcmp(vrr->ifaces[i], dev->name))
+			return 1;
+	return 0;
+}
+
+/* Must hold vrr->dev_lock */
+static struct vrr_interface_list *vrr_dev_find(struct vrr_node *vrr,
+					       int ifindex)
+{
+	struct vrr_interface_list *tmp;
+	struct list_head *pos;
+
+	list_for_each(pos, &vrr->dev_list.list) {
+		tmp = list_entry(pos, struct vrr_interface_list, list);
+		if (tmp->ifindex == ifindex)
+			return tmp;
+	}
+	return NULL;
+}
+
+/* Must hold vrr->dev_lock. Frames are sized for the smallest MTU of
+ * the interfaces that are up, since broadcasts go out on all of them;
+ * ETH_DATA_LEN while there is none. */
+static void vrr_dev_update_mtu(struct vrr_node *vrr)
+{
+	struct vrr_interface_list *tmp;
+	struct list_head *pos;
+	unsigned int mtu = 0;
+
+	list_for_each(pos, &vrr->dev_list.list) {
+		tmp = list_entry(pos, struct vrr_interface_list, list);
+		if (tmp->up && (!mtu || tmp->dev->mtu < mtu))
+			mtu = tmp->dev->mtu;
+	}
+	vrr->mtu = mtu ? mtu : ETH_DATA_LEN;
+}
+
+/* Attach, update or detach dev according to the enable list and its
+ * current link state. Called under rtnl. */
+static void vrr_dev_refresh(struct vrr_node *vrr, struct net_device *dev)
+{
+	struct vrr_interface_list *iface, *new = NULL, *old = NULL;
+	int enabled = vrr_dev_enabled(vrr, dev);
+	int up = netif_running(dev) && netif_carrier_ok(dev);
+	int lost = 0;
+	unsigned long flags;
+
+	if (enabled) {
+		new = kmalloc(sizeof(struct vrr_interface_list), GFP_KERNEL);
+		if (!new)
+			return;
+	}
+
+	spin_lock_irqsave(&vrr->dev_lock, flags);
+	iface = vrr_dev_find(vrr, dev->ifindex);
+	if (iface && !enabled) {
+		list_del(&iface->list);
+		lost = iface->up;
+		old = iface;
+	} else if (!iface && enabled) {
+		dev_hold(dev);
+		new->dev = dev;
+		new->ifindex = dev->ifindex;
+		new->up = 0;
+		list_add(&new->list, &vrr->dev_list.list);
+		iface = new;
+		new = NULL;
+	}
+	if (iface && enabled) {
+		strlcpy(iface->dev_name, dev->name, IFNAMSIZ);
+		if (iface->up != up)
+			VRR_INFO("%s %s", iface->dev_name, up ? "up" : "down");
+		lost = iface->up && !up;
+		iface->up = up;
+	}
+	vrr_dev_update_mtu(vrr);
+	spin_unlock_irqrestore(&vrr->dev_lock, flags);
+
+	if (old) {
+		VRR_INFO("Detached %s", old->dev_name);
+		dev_put(old->dev);
+		kfree(old);
+	}
+	kfree(new);
+
+	if (lost)
+		vrr_link_failed(vrr, dev->ifindex);
+}
+
+static void vrr_dev_remove(struct vrr_node *vrr, struct net_device *dev)
+{
+	struct vrr_interface_list *iface;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrr->dev_lock, flags);
+	iface = vrr_dev_find(vrr, dev->ifindex);
+	if (iface)
+		list_del(&iface->list);
+	vrr_dev_update_mtu(vrr);
+	spin_unlock_irqrestore(&vrr->dev_lock, flags);
+
+	if (iface) {
+		VRR_INFO("Detached %s", iface->dev_name);
+		dev_put(iface->dev);
+		kfree(iface);
+		vrr_link_failed(vrr, dev->ifindex);
+	}
+}
+
+static int vrr_dev_event(struct notifier_block *this, unsigned long event,
+			 void *ptr)
+{
+	struct net_device *dev = ptr;
+	struct vrr_node *vrr = vrr_get_node(dev_net(dev));
+
+	switch (event) {
+	case NETDEV_REGISTER:
+	case NETDEV_UP:
+	case NETDEV_DOWN:
+	case NETDEV_CHANGE:
+	case NETDEV_CHANGENAME:
+	case NETDEV_CHANGEMTU:
+		vrr_dev_refresh(vrr, dev);
+		break;
+	case NETDEV_UNREGISTER:
+		vrr_dev_remove(vrr, dev);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block vrr_dev_notifier = {
+	.notifier_call = vrr_dev_event,
+};
+
+/* Registering the notifier replays NETDEV_REGISTER and NETDEV_UP for
+ * the interfaces that already exist in every namespace. */
+int vrr_dev_init(void)
+{
+	return register_netdevice_notifier(&vrr_dev_notifier);
+}
+
+void vrr_dev_exit(void)
+{
+	unregister_netdevice_notifier(&vrr_dev_notifier);
+}
+
+void vrr_dev_node_init(struct vrr_node *vrr)
+{
+	INIT_LIST_HEAD(&vrr->dev_list.list);
+	spin_lock_init(&vrr->dev_lock);
+	vrr->mtu = ETH_DATA_LEN;
+
+	vrr->n_ifaces = 0;
+	if (vrr_dev_parse(vrr, ifaces))
+		VRR_ERR("Invalid interface list: %s", ifaces);
+}
+
+/* Drop every interface reference still held by the node */
+void vrr_dev_node_exit(struct vrr_node *vrr)
+{
+	struct vrr_interface_list *tmp, *q;
+
+	list_for_each_entry_safe(tmp, q, &vrr->dev_list.list, list) {
+		list_del(&tmp->list);
+		dev_put(tmp->dev);
+		kfree(tmp);
+	}
+}
+
+/* Replace the enable list and re-evaluate every interface of the
+ * namespace against it. An empty list restores the default. */
+int vrr_dev_set_enabled(struct vrr_node *vrr, const char *names)
+{
+	struct net_device *dev;
+	int err;
+
+	rtnl_lock();
+	err = vrr_dev_parse(vrr, names);
+	if (!err)
+		for_each_netdev(vrr->net, dev)
+			vrr_dev_refresh(vrr, dev);
+	rtnl_unlock();
+
+	return err;
+}
+
+ssize_t vrr_dev_show_enabled(struct vrr_node *vrr, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	rtnl_lock();
+	for (i = 0; i < vrr->n_ifaces; i++)
+		len += sprintf(buf + len, "%s\n", vrr->ifaces[i]);
+	rtnl_unlock();
+
+	return len;
+}
+
+ssize_t vrr_dev_show_attached(struct vrr_node *vrr, char *buf)
+{
+	struct vrr_interface_list *tmp;
+	struct list_head *pos;
+	unsigned long flags;
+	ssize_t len = 0;
+
+	spin_lock_irqsave(&vrr->dev_lock, flags);
+	list_for_each(pos, &vrr->dev_list.list) {
+		tmp = list_entry(pos, struct vrr_interface_list, list);
+		len += sprintf(buf + len, "%s %d %s\n", tmp->dev_name,
+			       tmp->ifindex, tmp->up ? "up" : "down");
+	}
+	spin_unlock_irqrestore(&vrr->dev_lock, flags);
+
+	return len;
+}
@@ -4,6 +4,7 @@
 #include <linux/netdevice.h>
 #include <linux/list.h>
 #include <linux/workqueue.h>
+#include <linux/jhash.h>
 #include <net/sock.h>
 #include "vrr.h"
 #include "vrr_data.h"
@@ -29,75 +30,293 @@ static int hello_trans[4][3] = {
 struct pset_update {
 	u32 node;
 	unsigned char mac[ETH_ALEN];
+	int ifindex;
 	int trans;
 	int active;
+	u32 seq;	/* of a full hello */
+	int full;
+	int deltas;
+	u32 links[2 * VRR_PSET_SIZE];	/* la and lna of a full hello */
+	int n_links;
+	u32 stamp;	/* arrival order across CPUs */
+	struct pset_update *next;
 	struct list_head list;
 };
 
-static struct pset_update pset_updates;
+/* Pending updates sit on a per-CPU lockless stack. vrr_rcv_hello
+ * pushes with cmpxchg from softirq, the handler takes a whole stack
+ * at once with xchg. There is a single consumer and it never pops
+ * single entries, so the push can't suffer from ABA. */
+struct vrr_update_queue {
+	struct pset_update *head;
+};
+
+static void pset_update_push(struct vrr_node *vrr, struct pset_update *update)
+{
+	struct vrr_update_queue *q;
+	struct pset_update *first;
 
-static DEFINE_SPINLOCK(pset_updates_lock);
+	update->stamp = atomic_inc_return(&vrr->pset_update_seq);
+
+	q = per_cpu_ptr(vrr->pset_updates, get_cpu());
+	do {
+		first = q->head;
+		update->next = first;
+	} while (cmpxchg(&q->head, first, update) != first);
+	put_cpu();
+}
 
-void __init vrr_init_rcv() 
+static inline int pset_update_newer(const struct pset_update *a,
+				    const struct pset_update *b)
 {
-	INIT_LIST_HEAD(&pset_updates.list);
+	return (s32)(a->stamp - b->stamp) > 0;
+}
+
+/* Take the updates of every CPU into batch. Hellos from a neighbor
+ * that repeat before the handler runs collapse into the newest full
+ * hello and the newest delta hello after it. The full one stays
+ * first, so that the base delta hellos apply to is set before the
+ * delta itself. */
+static void pset_update_drain(struct vrr_node *vrr, struct list_head *batch)
+{
+	struct pset_update *tmp, *next, *old, *full, *delta;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		tmp = xchg(&per_cpu_ptr(vrr->pset_updates, cpu)->head, NULL);
+		for (; tmp; tmp = next) {
+			next = tmp->next;
+
+			full = delta = NULL;
+			list_for_each_entry(old, batch, list) {
+				if (old->node != tmp->node)
+					continue;
+				if (old->full)
+					full = old;
+				else
+					delta = old;
+			}
+
+			if (!tmp->full) {
+				if ((full && pset_update_newer(full, tmp)) ||
+				    (delta && pset_update_newer(delta, tmp))) {
+					kfree(tmp);
+				} else if (delta) {
+					list_replace(&delta->list, &tmp->list);
+					kfree(delta);
+				} else {
+					list_add_tail(&tmp->list, batch);
+				}
+				continue;
+			}
+
+			if (full && pset_update_newer(full, tmp)) {
+				kfree(tmp);
+				continue;
+			}
+			if (delta && !pset_update_newer(delta, tmp)) {
+				list_del(&delta->list);
+				kfree(delta);
+				delta = NULL;
+			}
+			if (full) {
+				list_replace(&full->list, &tmp->list);
+				kfree(full);
+			} else if (delta) {
+				list_add_tail(&tmp->list, &delta->list);
+			} else {
+				list_add_tail(&tmp->list, batch);
+			}
+		}
+	}
 }
 
 void pset_update_handler(struct work_struct *work)
 {
-	struct list_head *pos, *q;
-	struct pset_update *tmp;
-	struct vrr_node *me = vrr_get_node();
+	struct pset_update *tmp, *q;
+	struct vrr_node *me = container_of(work, struct vrr_node,
+					   pset_updates_work);
 	int cur_state;
 	int next_state;
 	int cur_active;
-	
-	list_for_each_safe(pos, q, &pset_updates.list) {
-		tmp = list_entry(pos, struct pset_update, list);
-		cur_state = pset_get_status(tmp->node);
+	int changed = 0;
+	LIST_HEAD(updates);
+
+	pset_update_drain(me, &updates);
+
+	list_for_each_entry_safe(tmp, q, &updates, list) {
+		cur_state = pset_get_status(me, tmp->node);
 		next_state = hello_trans[cur_state][tmp->trans];
-		cur_active = pset_get_active(tmp->node);
+		cur_active = pset_get_active(me, tmp->node);
+
+		/* A link failed for its ETX stays failed until it
+		 * recovers well past the threshold */
+		if (cur_state == PSET_FAILED &&
+		    pset_get_etx(me, tmp->node) > VRR_ETX_RELINK)
+			next_state = PSET_FAILED;
 
 		VRR_DBG("%s[%s] ==> %s", pset_states[cur_state],
 			pset_trans[tmp->trans], pset_states[next_state]);
 
 		if (cur_state == PSET_UNKNOWN) {
-			pset_add(tmp->node, tmp->mac, next_state, tmp->active);
-			pset_state_update();
+			pset_add(me, tmp->node, tmp->mac, tmp->ifindex,
+				 next_state, tmp->active);
+			changed = 1;
 		} else if (cur_state != next_state ||
 			   cur_active != tmp->active) {
-			pset_update_status(tmp->node, next_state, tmp->active);
-			pset_state_update();
+			pset_update_status(me, tmp->node, next_state,
+					   tmp->active);
+			changed = 1;
+		}
+
+		/* Delta hellos from the node apply against this one */
+		if (tmp->full) {
+			pset_set_hello(me, tmp->node, tmp->seq, tmp->trans,
+				       tmp->deltas);
+			pset_set_links(me, tmp->node, tmp->links,
+				       tmp->n_links);
 		}
 
-		if (!me->active && tmp->active && next_state == PSET_LINKED)
-			send_setup_req(me->id, me->id, tmp->node);
+		/* While bootstrapping only the first active linked
+		 * neighbor is asked, the others would answer with
+		 * the same ring. */
+		if (!me->active && tmp->active && next_state == PSET_LINKED &&
+		    !(me->bootstrap && me->boot_proxy)) {
+			me->boot_proxy = tmp->node;
+			vrr_request_setup(me, me->id, tmp->node);
+		}
 
-		list_del(pos);
+		list_del(&tmp->list);
 		kfree(tmp);
 	}
 
-	INIT_LIST_HEAD(&pset_updates.list);
+	/* One rebuild for the whole batch */
+	if (changed)
+		pset_state_update(me);
 }
 
-static DECLARE_WORK(pset_updates_wq, pset_update_handler);
+/* Setup and teardown frames are handled away from the receive
+ * softirq, on the vrr_wq worker of the CPU they arrived on. */
+struct vrr_ctl_queue {
+	struct sk_buff_head prio;	/* teardowns */
+	struct sk_buff_head q;
+	struct work_struct work;
+	struct vrr_node *vrr;
+	int cpu;
+};
+
+static void vrr_ctl_handler(struct work_struct *work);
+
+/* Datagrams being reassembled from VRR_DATA_FRAG frames. A fixed
+ * number are held at once; one that sees no fragment for
+ * VRR_REASM_TIMEOUT, or the oldest one when all are busy, is dropped
+ * to make room. */
+struct vrr_reasm_ctx {
+	u32 src;
+	__be32 id;
+	unsigned long stamp;
+	u64 have;		/* bitmap of fragments received */
+	int count;
+	int total;
+	struct sk_buff *skb;	/* header and total bytes of data */
+};
+
+struct vrr_reasm {
+	spinlock_t lock;
+	struct vrr_reasm_ctx ctx[VRR_REASM_MAX];
+};
+
+int vrr_init_rcv(struct vrr_node *vrr)
+{
+	struct vrr_ctl_queue *ctl;
+	int cpu, i;
+
+	vrr->pset_updates = alloc_percpu(struct vrr_update_queue);
+	if (!vrr->pset_updates)
+		return -ENOMEM;
+
+	vrr->ctl = alloc_percpu(struct vrr_ctl_queue);
+	if (!vrr->ctl) {
+		free_percpu(vrr->pset_updates);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ctl = per_cpu_ptr(vrr->ctl, cpu);
+		skb_queue_head_init(&ctl->prio);
+		skb_queue_head_init(&ctl->q);
+		INIT_WORK(&ctl->work, vrr_ctl_handler);
+		ctl->vrr = vrr;
+		ctl->cpu = cpu;
+	}
+
+	atomic_set(&vrr->pset_update_seq, 0);
+	INIT_WORK(&vrr->pset_updates_work, pset_update_handler);
+
+	spin_lock_init(&vrr->ctl_lock);
+	for (i = 0; i < VRR_NPTYPES; i++)
+		vrr_bucket_init(&vrr->ctl_bucket[i], VRR_CTL_TYPE_BURST);
+
+	vrr->reasm = kzalloc(sizeof(struct vrr_reasm), GFP_KERNEL);
+	if (!vrr->reasm) {
+		free_percpu(vrr->ctl);
+		free_percpu(vrr->pset_updates);
+		return -ENOMEM;
+	}
+	spin_lock_init(&vrr->reasm->lock);
 
-static int vrr_local_rcv_setup(u32 dst, u32 pid, u32 proxy,
-			       u32 vset_size, u32 *vset);
-static int vrr_local_rcv_setup_fail(u32 dst, u32 proxy,
+	spin_lock_init(&vrr->dedup_lock);
+	memset(vrr->dedup, 0, sizeof(vrr->dedup));
+	return 0;
+}
+
+void vrr_exit_rcv(struct vrr_node *vrr)
+{
+	struct pset_update *tmp, *q;
+	struct vrr_ctl_queue *ctl;
+	LIST_HEAD(updates);
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		ctl = per_cpu_ptr(vrr->ctl, cpu);
+		cancel_work_sync(&ctl->work);
+		skb_queue_purge(&ctl->prio);
+		skb_queue_purge(&ctl->q);
+	}
+	free_percpu(vrr->ctl);
+
+	cancel_work_sync(&vrr->pset_updates_work);
+
+	pset_update_drain(vrr, &updates);
+	list_for_each_entry_safe(tmp, q, &updates, list) {
+		list_del(&tmp->list);
+		kfree(tmp);
+	}
+
+	free_percpu(vrr->pset_updates);
+
+	for (i = 0; i < VRR_REASM_MAX; i++)
+		kfree_skb(vrr->reasm->ctx[i].skb);
+	kfree(vrr->reasm);
+}
+
+static int vrr_local_rcv_setup(struct vrr_node *vrr, u32 dst, u32 pid,
+			       u32 proxy, u32 vset_size, u32 *vset);
+static int vrr_local_rcv_setup_fail(struct vrr_node *vrr, u32 dst, u32 proxy,
 				u32 vset_size, u32 *vset);
 
-static int vrr_rcv_data(struct sk_buff *skb, const struct vrr_header *vh)
+static int vrr_rcv_data(struct vrr_node *vrr, struct sk_buff *skb,
+			const struct vrr_header *vh)
 {
-	u32 src = ntohl(vh->src_id);
-	u32 dst = ntohl(vh->dest_id);
-	u32 me = get_vrr_id();
+	u32 src = vrr_hdr_src(vh);
+	u32 dst = vrr_hdr_dst(vh);
+	u32 me = get_vrr_id(vrr);
         int ret = 0;
 
 	VRR_DBG("Packet type: VRR_DATA");
 
         if (dst == me) {
-		struct sock *sk = vrr_find_sock(src);
+		struct sock *sk = vrr_find_sock(vrr, src);
 		
 		if (sk) {
 			ret = sk_receive_skb(sk, skb, 0);
@@ -107,12 +326,257 @@ static int vrr_rcv_data(struct sk_buff *skb, const struct vrr_header *vh)
 		VRR_DBG("No input socket found!");
                 return -1;
         } else 
-		vrr_forward(skb, vh);
+		vrr_forward(vrr, skb, vh);
 
 	return 0;
 }
 
-static int vrr_rcv_hello(struct sk_buff *skb, const struct vrr_header *vh)
+/* Must hold reasm->lock */
+static void vrr_reasm_drop(struct vrr_node *vrr, struct vrr_reasm_ctx *ctx)
+{
+	kfree_skb(ctx->skb);
+	ctx->skb = NULL;
+	VRR_INC_STAT(vrr, VRR_STAT_REASM_DROP);
+}
+
+/* Must hold reasm->lock */
+static struct vrr_reasm_ctx *vrr_reasm_find(struct vrr_node *vrr, u32 src,
+					    const struct vrr_frag_header *fh,
+					    const struct vrr_header *vh)
+{
+	struct vrr_reasm *r = vrr->reasm;
+	struct vrr_reasm_ctx *ctx, *free = NULL, *old = NULL;
+	unsigned long timeout = msecs_to_jiffies(VRR_REASM_TIMEOUT);
+	struct vrr_header *nvh;
+	int i, total = ntohs(fh->total);
+
+	for (i = 0; i < VRR_REASM_MAX; i++) {
+		ctx = &r->ctx[i];
+		if (ctx->skb && time_after(jiffies, ctx->stamp + timeout))
+			vrr_reasm_drop(vrr, ctx);
+		if (!ctx->skb) {
+			if (!free)
+				free = ctx;
+			continue;
+		}
+		if (ctx->src == src && ctx->id == fh->id)
+			return (ctx->count == fh->count &&
+				ctx->total == total) ? ctx : NULL;
+		if (!old || time_before(ctx->stamp, old->stamp))
+			old = ctx;
+	}
+
+	if (!free) {
+		vrr_reasm_drop(vrr, old);
+		free = old;
+	}
+
+	ctx = free;
+	ctx->skb = vrr_skb_alloc(sizeof(struct vrr_header) + total,
+				 GFP_ATOMIC);
+	if (!ctx->skb)
+		return NULL;
+
+	nvh = (struct vrr_header *)skb_put(ctx->skb, sizeof(struct vrr_header));
+	memcpy(nvh, vh, sizeof(struct vrr_header));
+	nvh->pkt_type = VRR_DATA;
+	nvh->data_len = htons(total);
+	skb_put(ctx->skb, total);
+	skb_reset_network_header(ctx->skb);
+
+	ctx->src = src;
+	ctx->id = fh->id;
+	ctx->have = 0;
+	ctx->count = fh->count;
+	ctx->total = total;
+	return ctx;
+}
+
+/* Fragments are forwarded as they are; only the destination puts the
+ * datagram back together and hands it to vrr_rcv_data. A frame may
+ * carry several consecutive fragments once GRO has merged them. */
+static int vrr_rcv_data_frag(struct vrr_node *vrr, struct sk_buff *skb,
+			     const struct vrr_header *vh)
+{
+	u32 src = ntohl(vh->src_id);
+	u32 dst = ntohl(vh->dest_id);
+	size_t offset = sizeof(struct vrr_header);
+	struct vrr_reasm *r = vrr->reasm;
+	struct vrr_reasm_ctx *ctx;
+	struct vrr_frag_header fh;
+	struct vrr_header *nvh;
+	struct sk_buff *done = NULL;
+	unsigned long flags;
+	u64 mask;
+	int n, off;
+
+	VRR_DBG("Packet type: VRR_DATA_FRAG");
+
+	if (dst != get_vrr_id(vrr)) {
+		vrr_forward(vrr, skb, vh);
+		return 0;
+	}
+
+	if (skb_copy_bits(skb, offset, &fh, sizeof(fh)))
+		return -1;
+	offset += sizeof(fh);
+	n = ntohs(vh->data_len) - (int)sizeof(fh);
+	off = ntohs(fh.offset);
+
+	if (!fh.count || fh.count > VRR_FRAG_MAX || !fh.span ||
+	    fh.index + fh.span > fh.count || n <= 0 ||
+	    offset + n > skb->len || off + n > ntohs(fh.total) ||
+	    (fh.span == fh.count && (off || n != ntohs(fh.total)))) {
+		VRR_DBG("Invalid fragment from %x. Dropping packet.", src);
+		return -1;
+	}
+
+	/* A whole datagram, coalesced by GRO, loses its fragment
+	 * header and is delivered as it is */
+	if (fh.span == fh.count && !skb_cow_head(skb, 0) &&
+	    pskb_may_pull(skb, offset)) {
+		memmove(skb->data + sizeof(fh), skb->data,
+			sizeof(struct vrr_header));
+		skb_pull(skb, sizeof(fh));
+		skb_reset_network_header(skb);
+		nvh = (struct vrr_header *)skb->data;
+		nvh->pkt_type = VRR_DATA;
+		nvh->data_len = fh.total;
+		VRR_INC_STAT(vrr, VRR_STAT_REASM_OK);
+		return vrr_rcv_data(vrr, skb, nvh);
+	}
+
+	mask = (fh.span == 64 ? ~0ULL : (1ULL << fh.span) - 1) << fh.index;
+
+	spin_lock_irqsave(&r->lock, flags);
+	ctx = vrr_reasm_find(vrr, src, &fh, vh);
+	if (ctx && !(ctx->have & mask)) {
+		skb_copy_bits(skb, offset, ctx->skb->data +
+			      sizeof(struct vrr_header) + off, n);
+		ctx->have |= mask;
+		ctx->stamp = jiffies;
+		if (ctx->have == ~0ULL >> (64 - ctx->count)) {
+			done = ctx->skb;
+			ctx->skb = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	kfree_skb(skb);
+
+	if (done) {
+		VRR_INC_STAT(vrr, VRR_STAT_REASM_OK);
+		if (vrr_rcv_data(vrr, done, vrr_hdr(done)))
+			kfree_skb(done);
+	}
+	return 0;
+}
+
+/* GRO: consecutive fragments of a datagram for us, from the same
+ * neighbor, are merged into one frame before vrr_rcv sees them.
+ * Fragments we forward are left alone so they still fit the link. */
+struct sk_buff **vrr_gro_receive(struct sk_buff **head, struct sk_buff *skb)
+{
+	struct vrr_node *vrr = vrr_get_node(dev_net(skb->dev));
+	const unsigned int hlen = sizeof(struct vrr_header) +
+		sizeof(struct vrr_frag_header);
+	struct sk_buff **pp = NULL, *p;
+	struct vrr_header *vh, *vh2;
+	struct vrr_frag_header *fh, *fh2;
+	unsigned int off;
+	int flush = 1;
+
+	off = skb_gro_offset(skb);
+	vh = skb_gro_header_fast(skb, off);
+	if (skb_gro_header_hard(skb, off + hlen)) {
+		vh = skb_gro_header_slow(skb, off + hlen, off);
+		if (unlikely(!vh))
+			goto out;
+	}
+	fh = (struct vrr_frag_header *)(vh + 1);
+
+	/* Padded frames can't be merged as they are */
+	if (vh->pkt_type != VRR_DATA_FRAG ||
+	    ntohl(vh->dest_id) != get_vrr_id(vrr) || fh->span != 1 ||
+	    ntohs(vh->data_len) + sizeof(struct vrr_header) !=
+	    skb_gro_len(skb))
+		goto out;
+
+	/* Pull the headers of every candidate, as IP does, so that a
+	 * frame held for merging has them in its linear area and a
+	 * frag_list head built by skb_gro_receive() gets a copy */
+	skb_gro_pull(skb, hlen);
+
+	flush = 0;
+	for (; (p = *head); head = &p->next) {
+		if (!NAPI_GRO_CB(p)->same_flow)
+			continue;
+
+		/* Held frames sit at the same GRO offset */
+		vh2 = (struct vrr_header *)(p->data + off);
+		fh2 = (struct vrr_frag_header *)(vh2 + 1);
+		if (vh2->src_id != vh->src_id || fh2->id != fh->id ||
+		    fh2->index + NAPI_GRO_CB(p)->count != fh->index) {
+			NAPI_GRO_CB(p)->same_flow = 0;
+			continue;
+		}
+		goto found;
+	}
+	goto out_check;
+
+found:
+	if (skb_gro_receive(head, skb)) {
+		/* Full, send both up */
+		flush = 1;
+		pp = head;
+		goto out;
+	}
+	p = *head;
+
+out_check:
+	/* The last fragment completes the datagram */
+	if (fh->index + 1 == fh->count) {
+		if (p)
+			pp = head;
+		else
+			flush = 1;
+	}
+out:
+	NAPI_GRO_CB(skb)->flush |= flush;
+	return pp;
+}
+
+/* Make a merged frame look like one fragment spanning the others.
+ * vrr_gro_receive() left both headers in the linear area. */
+int vrr_gro_complete(struct sk_buff *skb)
+{
+	struct vrr_header *vh;
+	struct vrr_frag_header *fh;
+
+	if (skb_headlen(skb) < skb_network_offset(skb) +
+	    sizeof(*vh) + sizeof(*fh))
+		return -EINVAL;
+	vh = (struct vrr_header *)skb_network_header(skb);
+	fh = (struct vrr_frag_header *)(vh + 1);
+
+	fh->span = NAPI_GRO_CB(skb)->count;
+	vh->data_len = htons(skb->len - skb_network_offset(skb) -
+			     sizeof(struct vrr_header));
+	skb_shinfo(skb)->gso_size = 0;
+	return 0;
+}
+
+static int vrr_queue_pset_update(struct vrr_node *vrr,
+				 struct pset_update *update)
+{
+	pset_update_push(vrr, update);
+	queue_work(vrr_wq, &vrr->pset_updates_work);
+
+	return 0;
+}
+
+static int vrr_rcv_hello(struct vrr_node *vrr, struct sk_buff *skb,
+			 const struct vrr_header *vh)
 {
 	int active;
         u32 src = ntohl(vh->src_id);
@@ -122,8 +586,10 @@ static int vrr_rcv_hello(struct sk_buff *skb, const struct vrr_header *vh)
         size_t step = sizeof(u32);
 	int trans = TRANS_MISSING;
         unsigned char src_addr[ETH_ALEN];
-        struct vrr_node *me = vrr_get_node();
+        struct vrr_node *me = vrr;
 	struct pset_update *update = NULL;
+	u32 seq = 0;
+	int deltas = 0;
 
 	VRR_DBG("Packet type: VRR_HELLO");
 
@@ -202,6 +668,16 @@ static int vrr_rcv_hello(struct sk_buff *skb, const struct vrr_header *vh)
                 }
         }
 
+        /* Trailing seq, only sent by nodes that send delta hellos.
+         * Bound by data_len, not skb->len, which counts link padding */
+        if (offset + step <= sizeof(struct vrr_header) +
+            vrr_hdr_data_len(vh) && skb->len >= offset + step) {
+                skb_copy_bits(skb, offset, &seq, step);
+                seq = ntohl(seq);
+                deltas = 1;
+                pset_hello_rx(vrr, src, seq);
+        }
+
 	update = (struct pset_update *)
 		kmalloc(sizeof(struct pset_update), GFP_ATOMIC);
 	if (!update)
@@ -209,17 +685,122 @@ static int vrr_rcv_hello(struct sk_buff *skb, const struct vrr_header *vh)
 	
 	update->node = src;
 	memcpy(update->mac, src_addr, ETH_ALEN);
+	update->ifindex = skb->dev->ifindex;
 	update->trans = trans;
 	update->active = active;
-	
-	list_add_tail(&update->list, &pset_updates.list);
+	update->seq = seq;
+	update->full = 1;
+	update->deltas = deltas;
+	memcpy(update->links, la, la_size * sizeof(u32));
+	memcpy(update->links + la_size, lna, lna_size * sizeof(u32));
+	update->n_links = la_size + lna_size;
+
+	return vrr_queue_pset_update(vrr, update);
+}
 
-	schedule_work(&pset_updates_wq);
+/* Where a delta hello puts us, by the list it names */
+static int delta_trans[4] = {
+	TRANS_LINKED,	/* VRR_HELLO_LA */
+	TRANS_LINKED,	/* VRR_HELLO_LNA */
+	TRANS_PENDING,	/* VRR_HELLO_P */
+	TRANS_MISSING};	/* VRR_HELLO_GONE */
+
+/* A delta hello lists only the pset entries of the sender that
+ * changed since its full hello base_seq. If we are not among them
+ * our place is the one that full hello gave us. */
+static int vrr_rcv_hello_delta(struct vrr_node *vrr, struct sk_buff *skb,
+			       const struct vrr_header *vh)
+{
+        u32 src = ntohl(vh->src_id);
+	u32 hdr[4], pair[2], base_seq, n, i;
+	size_t offset = sizeof(struct vrr_header);
+        unsigned char src_addr[ETH_ALEN];
+	struct pset_update *update;
+	int trans;
 
-	return 0;
+	VRR_DBG("Packet type: VRR_HELLO_DELTA");
+
+	if (skb_copy_bits(skb, offset, hdr, sizeof(hdr)))
+		return -1;
+	offset += sizeof(hdr);
+
+	pset_hello_rx(vrr, src, ntohl(hdr[1]));
+
+	n = ntohl(hdr[3]);
+	if (n > VRR_HELLO_DELTA_MAX) {
+		VRR_DBG("Invalid delta size: %x. Dropping packet.", n);
+		return -1;
+	}
+
+	if (pset_get_hello(vrr, src, &base_seq, &trans) ||
+	    base_seq != ntohl(hdr[2])) {
+		VRR_DBG("No full hello %x from %x", ntohl(hdr[2]), src);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (skb_copy_bits(skb, offset, pair, sizeof(pair)))
+			return -1;
+		offset += sizeof(pair);
+		if (ntohl(pair[1]) > VRR_HELLO_GONE)
+			return -1;
+		if (ntohl(pair[0]) == vrr->id)
+			trans = delta_trans[ntohl(pair[1])];
+	}
+
+        eth_header_parse(skb, src_addr);
+
+	update = (struct pset_update *)
+		kmalloc(sizeof(struct pset_update), GFP_ATOMIC);
+	if (!update)
+		return -1;
+
+	update->node = src;
+	memcpy(update->mac, src_addr, ETH_ALEN);
+	update->ifindex = skb->dev->ifindex;
+	update->trans = trans;
+	update->active = ntohl(hdr[0]);
+	update->full = 0;
+
+	return vrr_queue_pset_update(vrr, update);
+}
+
+/* Returns 1 if the same setup frame went through here less than
+ * VRR_DEDUP_TIMEOUT ago, otherwise remembers it. The cache is direct
+ * mapped; a colliding frame simply evicts the older one. */
+static int vrr_dedup_seen(struct vrr_node *vrr, u8 pkt_type, u32 src,
+			  u32 dst, u32 id)
+{
+	struct vrr_dedup_entry *e;
+	unsigned long flags, now = jiffies;
+	int seen;
+
+	e = &vrr->dedup[jhash_3words(src, dst, id, pkt_type) &
+			(VRR_DEDUP_SIZE - 1)];
+
+	spin_lock_irqsave(&vrr->dedup_lock, flags);
+	seen = e->stamp && e->pkt_type == pkt_type && e->src == src &&
+		e->dst == dst && e->id == id &&
+		time_before(now, e->stamp + msecs_to_jiffies(VRR_DEDUP_TIMEOUT));
+	if (!seen) {
+		e->src = src;
+		e->dst = dst;
+		e->id = id;
+		e->pkt_type = pkt_type;
+		e->stamp = now ? now : 1;
+	}
+	spin_unlock_irqrestore(&vrr->dedup_lock, flags);
+
+	if (seen) {
+		VRR_DBG("Duplicate %x from %x to %x (%x)", pkt_type, src,
+			dst, id);
+		VRR_INC_STAT(vrr, VRR_STAT_DEDUP_HIT);
+	}
+	return seen;
 }
 
-static int vrr_rcv_setup_req(struct sk_buff *skb, const struct vrr_header *vh)
+static int vrr_rcv_setup_req(struct vrr_node *vrr, struct sk_buff *skb,
+			     const struct vrr_header *vh)
 {
 	u32 nh, src, dst, proxy, vset_size, ovset_size, i;
 	u32 *vset = NULL, *ovset = NULL;
@@ -229,17 +810,22 @@ static int vrr_rcv_setup_req(struct sk_buff *skb, const struct vrr_header *vh)
         src = ntohl(vh->src_id);
         dst = ntohl(vh->dest_id);
 
-	nh = rt_get_next_exclude(dst, src);
+	skb_copy_bits(skb, offset, &proxy, step);
+	proxy = ntohl(proxy);
+	offset += step;
+
+	if (vrr_dedup_seen(vrr, VRR_SETUP_REQ, src, dst, proxy)) {
+		kfree_skb(skb);
+		return 0;
+	}
+
+	nh = rt_get_next_exclude(vrr, dst, src);
 	if (nh) {
                 VRR_DBG("Forwarding to next hop: %x", nh);
-		vrr_forward_setup_req(skb, vh, nh);
+		vrr_forward_setup_req(vrr, skb, vh, nh);
 		return 0;
 	}
 
-	skb_copy_bits(skb, offset, &proxy, step);
-	proxy = ntohl(proxy);
-	offset += step;
-
 	skb_copy_bits(skb, offset, &vset_size, step);
 	vset_size = ntohl(vset_size);
 	offset += step;
@@ -261,15 +847,15 @@ static int vrr_rcv_setup_req(struct sk_buff *skb, const struct vrr_header *vh)
 		vset[i] = ntohl(vset[i]);
 	}
 
-	ovset_size = vset_get_all(&ovset);
-	if (vrr_add(src, vset_size, vset)) {
+	ovset_size = vset_get_all(vrr, &ovset);
+	if (vrr_add(vrr, src, vset_size, vset)) {
 		/* Send <setup, me, src, NewPid(), proxy, ovset> to me */
-                vrr_local_rcv_setup(src, vrr_new_path_id(), proxy,
+                vrr_local_rcv_setup(vrr, src, vrr_new_path_id(), proxy,
 				    ovset_size, ovset);
 		goto out;
 	}
         else {
-		vrr_local_rcv_setup_fail(src, proxy, ovset_size,
+		vrr_local_rcv_setup_fail(vrr, src, proxy, ovset_size,
  					ovset);
 		goto out;		
 	}
@@ -280,7 +866,7 @@ out:
 	return 0;
 }
 
-static int vrr_rcv_setup_fail(struct sk_buff *skb, 
+static int vrr_rcv_setup_fail(struct vrr_node *vrr, struct sk_buff *skb, 
 				const struct vrr_header *vh)
 {
 	u32 nh, src, dst, proxy;
@@ -321,26 +907,28 @@ static int vrr_rcv_setup_fail(struct sk_buff *skb,
 		vset[i] = ntohl(vset[i]);
 	}
 
-        if (pset_get_status(dst) == PSET_UNKNOWN)
-                nh = rt_get_next(proxy);
+        if (pset_get_status(vrr, dst) == PSET_UNKNOWN)
+                nh = rt_get_next(vrr, proxy);
         else
                 nh = dst;
 
         if (nh) {
                 /* Send <setup_fail, src, dst, proxy, vset'> to nh */
-                send_setup_fail(src, dst, proxy, vset_size, vset, nh);
+                send_setup_fail(vrr, src, dst, proxy, vset_size, vset, nh);
                 return 0;
         }
 
-        if (dst == get_vrr_id()) {
+        if (dst == get_vrr_id(vrr)) {
+		vrr_setup_done(vrr, src);
 		vset[i+1] = ntohl(src);
- 		vrr_add(-1, vset_size, vset);
+ 		vrr_add(vrr, -1, vset_size, vset);
 	}
 
 	return 0;
 }
 
-static int vrr_rcv_setup(struct sk_buff *skb, const struct vrr_header *vh)
+static int vrr_rcv_setup(struct vrr_node *vrr, struct sk_buff *skb,
+			 const struct vrr_header *vh)
 {
         u32 nh, src, dst, pid, proxy, sender;
         u32 *vset, vset_size;
@@ -348,7 +936,7 @@ static int vrr_rcv_setup(struct sk_buff *skb, const struct vrr_header *vh)
         size_t step = sizeof(u32);
         int in_pset, i;
         unsigned char src_addr[ETH_ALEN];
-	struct vrr_node *me = vrr_get_node();
+	struct vrr_node *me = vrr;
 
 	VRR_DBG("Packet type: VRR_SETUP");
 
@@ -365,31 +953,36 @@ static int vrr_rcv_setup(struct sk_buff *skb, const struct vrr_header *vh)
 
 	VRR_DBG("src:%x dst:%x proxy:%x pid:%x", src, dst, proxy, pid);
 
+	if (vrr_dedup_seen(vrr, VRR_SETUP, src, dst, pid)) {
+		kfree_skb(skb);
+		return 0;
+	}
+
         eth_header_parse(skb, src_addr);
 
 
         if (!memcmp(skb->dev->dev_addr, src_addr, ETH_ALEN)) {
                 VRR_DBG("Received setup from myself");
-                sender = get_vrr_id();
+                sender = get_vrr_id(vrr);
         } else {
-                in_pset = pset_lookup_mac(src_addr, &sender);
+                in_pset = pset_lookup_mac(vrr, src_addr, &sender);
                 if (!in_pset) {
-			tear_down_path(pid, src, null);
+			tear_down_path(vrr, pid, src, 0);
                         VRR_DBG("Sender is not in pset!");
                         return 0;
                 }
         }
 
-        if (pset_get_status(dst) == PSET_UNKNOWN)
-		nh = (dst == me->id) ? 0 : rt_get_next(proxy);
+        if (pset_get_status(vrr, dst) == PSET_UNKNOWN)
+		nh = (dst == me->id) ? 0 : rt_get_next(vrr, proxy);
         else
                 nh = dst;
 
 	VRR_DBG("nh: %x", nh);
 
-        if (!rt_add_route(src, dst, sender, nh, pid)) {
+        if (!rt_add_route(vrr, src, dst, sender, nh, pid)) {
                 /* TearDownPath(<pid, src>, null) */
-		tear_down_path(pid, src, null);
+		tear_down_path(vrr, pid, src, 0);
 		VRR_DBG("Couldn't add route. Should tear down path to %x", src);
                 return 0;
         }
@@ -417,13 +1010,14 @@ static int vrr_rcv_setup(struct sk_buff *skb, const struct vrr_header *vh)
 
         if (nh) {
                 /* Send <setup, src, dst, pid, proxy, vset'> to nh */
-                send_setup(src, dst, pid, proxy, vset_size, vset, nh);
+                send_setup(vrr, src, dst, pid, proxy, vset_size, vset, nh);
                 return 0;
         }
 
-        if (vrr_add(src, vset_size, vset)) {
+        vrr_setup_done(vrr, src);
+        if (vrr_add(vrr, src, vset_size, vset)) {
 		VRR_DBG("Yay! Received multi-hop setup message from %x!", src);
-		me->active = 1;
+		vrr_set_active(vrr);
                 return 0;
 	} else {
 		VRR_DBG("Coudn't add %x. Should tear down %x.", src, src);
@@ -431,11 +1025,12 @@ static int vrr_rcv_setup(struct sk_buff *skb, const struct vrr_header *vh)
 	}
 
         /* TearDownPath(<pid, src>, null>) */
-	tear_down_path(pid, src, null);
+	tear_down_path(vrr, pid, src, 0);
 	return 0;
 }
 
-static int vrr_rcv_teardown(struct sk_buff *skb, const struct vrr_header *vh) 
+static int vrr_rcv_teardown(struct vrr_node *vrr, struct sk_buff *skb,
+			    const struct vrr_header *vh) 
 {
 	u32 src, dst, ea, endpt, pid, next, proxy;
         u32 *vset, vset_size;
@@ -461,7 +1056,7 @@ static int vrr_rcv_teardown(struct sk_buff *skb, const struct vrr_header *vh)
 	vset_size = ntohl(vset_size);
 	offset += step;
 
-	route = rt_remove_route(ea, pid);
+	route = rt_remove_route(vrr, ea, pid);
 	
 	if (route && route->na == src) {
 		endpt = route->eb;
@@ -489,56 +1084,244 @@ static int vrr_rcv_teardown(struct sk_buff *skb, const struct vrr_header *vh)
 	}
 
 	if (next) 
-		send_teardown(pid, ea, vset, vset_size, next);
+		send_teardown(vrr, pid, ea, vset, vset_size, next);
 	else {
-		vset_remove(endpt);
+		vset_remove(vrr, endpt);
 		if (vset)
-			vrr_add(0, vset_size, vset);
+			vrr_add(vrr, 0, vset_size, vset);
 		else {
-			if(pset_get_proxy(&proxy)) 
-				send_setup_req(get_vrr_id(), endpt, proxy);
+			if(pset_get_proxy(vrr, endpt, 0, &proxy)) 
+				vrr_request_setup(vrr, endpt, proxy);
+		}
+	}
+	return 0;
+}
+
+/* One step of a local repair started by the lower id end of a failed
+ * link, see vrr_repair_routes(). na and nb are the next hops of the
+ * relay in every step; one of them is the initiator, the other the
+ * far end. */
+static int vrr_rcv_repair(struct vrr_node *vrr, struct sk_buff *skb,
+			  const struct vrr_header *vh)
+{
+	u32 src = ntohl(vh->src_id);
+	u32 data[6], step, ea, eb, pid, na, nb, other;
+	size_t offset = sizeof(struct vrr_header);
+	int i;
+
+	VRR_DBG("Packet type: VRR_REPAIR");
+
+	if (skb_copy_bits(skb, offset, data, sizeof(data)))
+		return -1;
+	for (i = 0; i < 6; i++)
+		data[i] = ntohl(data[i]);
+	step = data[0];
+	ea = data[1];
+	eb = data[2];
+	pid = data[3];
+	na = data[4];
+	nb = data[5];
+
+	/* A splice comes from the initiator and an ack from the far
+	 * end, both next hops of the relay. Notify, fail and done come
+	 * from the relay and name us as one of its next hops; other is
+	 * then the hop the relay stands in for. */
+	if (step == VRR_REPAIR_SPLICE || step == VRR_REPAIR_ACK) {
+		if (na != src && nb != src) {
+			VRR_DBG("Repair from %x not next to it. "
+				"Dropping packet.", src);
+			return -1;
+		}
+		other = (na == src) ? nb : na;
+	} else {
+		if (na != vrr->id && nb != vrr->id) {
+			VRR_DBG("Repair from %x not next to us. "
+				"Dropping packet.", src);
+			return -1;
+		}
+		other = (na == vrr->id) ? nb : na;
+	}
+
+	switch (step) {
+	case VRR_REPAIR_SPLICE:
+		/* We relay between the initiator and the far end */
+		if (pset_get_status(vrr, other) != PSET_LINKED ||
+		    !rt_add_route(vrr, ea, eb, na, nb, pid)) {
+			send_repair(vrr, VRR_REPAIR_FAIL, ea, eb, pid, na, nb,
+				    src);
+			break;
 		}
+		send_repair(vrr, VRR_REPAIR_NOTIFY, ea, eb, pid, na, nb,
+			    other);
+		break;
+	case VRR_REPAIR_NOTIFY:
+		/* The relay replaces the initiator as our next hop. If
+		 * we already tore the path down the relay must too. */
+		if (rt_replace_next(vrr, ea, eb, pid, other, src))
+			send_repair(vrr, VRR_REPAIR_ACK, ea, eb, pid, na, nb,
+				    src);
+		else
+			send_teardown(vrr, pid, ea, NULL, 0, src);
+		break;
+	case VRR_REPAIR_ACK:
+		/* The far end took us; tell the initiator */
+		send_repair(vrr, VRR_REPAIR_DONE, ea, eb, pid, na, nb, other);
+		break;
+	case VRR_REPAIR_FAIL:
+		vrr_repair_failed(vrr, ea, eb, pid, src);
+		break;
+	case VRR_REPAIR_DONE:
+		vrr_repair_done(vrr, ea, eb, pid, src);
+		break;
+	default:
+		return -1;
 	}
+
+	kfree_skb(skb);
 	return 0;
 }
 
-static int (*vrr_rcvfunc[6])(struct sk_buff *, const struct vrr_header *) = {
+static int vrr_rcv_aggr(struct vrr_node *vrr, struct sk_buff *skb,
+			const struct vrr_header *vh);
+
+static int (*vrr_rcvfunc[VRR_NPTYPES])(struct vrr_node *, struct sk_buff *,
+				       const struct vrr_header *) = {
 	&vrr_rcv_data,
 	&vrr_rcv_hello,
 	&vrr_rcv_setup_req,
 	&vrr_rcv_setup,
 	&vrr_rcv_setup_fail,
-	&vrr_rcv_teardown
+	&vrr_rcv_teardown,
+	&vrr_rcv_hello_delta,
+	&vrr_rcv_repair,
+	&vrr_rcv_aggr,
+	&vrr_rcv_data_frag
 };
 
-int vrr_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt,
-	    struct net_device *orig_dev)
+static void vrr_ctl_handler(struct work_struct *work)
 {
-	const struct vrr_header *vh = vrr_hdr(skb);
-	int err;
+	struct vrr_ctl_queue *ctl = container_of(work, struct vrr_ctl_queue,
+						 work);
+	struct vrr_node *vrr = ctl->vrr;
+	const struct vrr_header *vh;
+	struct sk_buff *skb;
+	int budget = VRR_CTL_BUDGET;
+
+	while (budget && ((skb = skb_dequeue(&ctl->prio)) ||
+			  (skb = skb_dequeue(&ctl->q)))) {
+		vh = vrr_hdr(skb);
+		if ((*vrr_rcvfunc[vh->pkt_type])(vrr, skb, vh)) {
+			VRR_ERR("Error in rcv func.");
+			kfree_skb(skb);
+		}
+		VRR_INC_STAT(vrr, VRR_STAT_CTL_DONE);
+		budget--;
+	}
 
-        WARN_ATOMIC;
+	/* Requeue behind the hello and pset work instead of running
+	 * the whole backlog at once */
+	if (!skb_queue_empty(&ctl->prio) || !skb_queue_empty(&ctl->q)) {
+		VRR_INC_STAT(vrr, VRR_STAT_CTL_BUDGET);
+		queue_work_on(ctl->cpu, vrr_wq, &ctl->work);
+	}
+}
 
-	printk(KERN_ALERT "Received a VRR packet!");
+static int vrr_is_ctl(u8 pkt_type)
+{
+	return pkt_type == VRR_SETUP_REQ || pkt_type == VRR_SETUP ||
+		pkt_type == VRR_SETUP_FAIL || pkt_type == VRR_TEARDOWN ||
+		pkt_type == VRR_REPAIR;
+}
 
-	/* VRR_INFO("vrr_version: %x", vh->vrr_version); */
-	/* VRR_INFO("pkt_type: %x", vh->pkt_type); */
-	/* VRR_INFO("protocol: %x", ntohs(vh->protocol)); */
-	/* VRR_INFO("data_len: %x", ntohs(vh->data_len)); */
-	/* VRR_INFO("free: %x", vh->free); */
-	/* VRR_INFO("h_csum: %x", vh->h_csum); */
-	/* VRR_INFO("src_id: %x", ntohl(vh->src_id)); */
-	/* VRR_INFO("dest_id: %x", ntohl(vh->dest_id)); */
+static int vrr_ctl_type_admit(struct vrr_node *vrr, u8 pkt_type)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&vrr->ctl_lock, flags);
+	ret = vrr_bucket_take(&vrr->ctl_bucket[pkt_type], VRR_CTL_TYPE_RATE,
+			      VRR_CTL_TYPE_BURST);
+	spin_unlock_irqrestore(&vrr->ctl_lock, flags);
+	return ret;
+}
+
+/* Setup frames from a neighbor, and of each type, are admitted at a
+ * bounded rate so that a storm can't take over the control worker.
+ * Teardowns are never throttled and are handled first; they free
+ * state rather than create it. */
+static int vrr_ctl_enqueue(struct vrr_node *vrr, struct sk_buff *skb,
+			   const unsigned char *src_addr)
+{
+	int cpu = smp_processor_id();
+	struct vrr_ctl_queue *ctl = per_cpu_ptr(vrr->ctl, cpu);
+	u8 pkt_type = vrr_hdr(skb)->pkt_type;
+
+	if (skb_queue_len(&ctl->prio) + skb_queue_len(&ctl->q) >=
+	    VRR_CTL_BACKLOG) {
+		VRR_INC_STAT(vrr, VRR_STAT_CTL_BACKLOG);
+		return -1;
+	}
+
+	if (pkt_type == VRR_TEARDOWN) {
+		skb_queue_tail(&ctl->prio, skb);
+	} else if (!pset_ctl_admit(vrr, src_addr)) {
+		VRR_INC_STAT(vrr, VRR_STAT_CTL_NEIGH);
+		return -1;
+	} else if (!vrr_ctl_type_admit(vrr, pkt_type)) {
+		VRR_INC_STAT(vrr, VRR_STAT_CTL_TYPE);
+		return -1;
+	} else {
+		skb_queue_tail(&ctl->q, skb);
+	}
+
+	VRR_INC_STAT(vrr, VRR_STAT_CTL_QUEUED);
+	queue_work_on(cpu, vrr_wq, &ctl->work);
+	return 0;
+}
+
+int vrr_ctl_backlog(struct vrr_node *vrr)
+{
+	int cpu, n = 0;
+
+	for_each_possible_cpu(cpu)
+		n += skb_queue_len(&per_cpu_ptr(vrr->ctl, cpu)->prio) +
+			skb_queue_len(&per_cpu_ptr(vrr->ctl, cpu)->q);
+	return n;
+}
+
+/* Dispatch one VRR frame, on its own or out of an aggregate */
+static int vrr_rcv_frame(struct vrr_node *vrr, struct sk_buff *skb,
+			 const unsigned char *src_addr)
+{
+	const struct vrr_header *vh;
+	int err;
+
+	if (!pskb_may_pull(skb, sizeof(struct vrr_data_header)) ||
+	    !pskb_may_pull(skb, vrr_hdr_len(vrr_hdr(skb)))) {
+		VRR_DBG("Frame too short for its header");
+		goto drop;
+	}
+	vh = vrr_hdr(skb);
 
 	if (vh->pkt_type < 0 || vh->pkt_type >= VRR_NPTYPES) {
 		VRR_ERR("Unknown pkt_type: %x", vh->pkt_type);
 		goto drop;
 	}
 
-	reset_active_timeout();
-        pset_reset_fail_count(ntohl(vh->src_id));
+	/* Only data frames come with the compact header */
+	if (vrr_hdr_compact(vh) && vh->pkt_type != VRR_DATA) {
+		VRR_ERR("Compact header on pkt_type: %x", vh->pkt_type);
+		goto drop;
+	}
+
+	/* Keep setup and teardown processing out of the data path */
+	if (vrr_is_ctl(vh->pkt_type)) {
+		if (vrr_ctl_enqueue(vrr, skb, src_addr))
+			goto drop;
+		return NET_RX_SUCCESS;
+	}
 
-	err = (*vrr_rcvfunc[vh->pkt_type])(skb, vh);
+	err = (*vrr_rcvfunc[vh->pkt_type])(vrr, skb, vh);
 
 	if (err) {
 		VRR_ERR("Error in rcv func.");
@@ -551,20 +1334,100 @@ drop:
 	return NET_RX_DROP;
 }
 
-int vrr_local_rcv_setup(u32 dst, u32 pid, u32 proxy,
+/* Each frame of an aggregate is copied out with the link header of
+ * the aggregate in front, and handled as if it came in on its own */
+static int vrr_rcv_aggr(struct vrr_node *vrr, struct sk_buff *skb,
+			const struct vrr_header *vh)
+{
+	size_t offset = sizeof(struct vrr_header);
+	unsigned char src_addr[ETH_ALEN];
+	struct sk_buff *frame;
+	__be16 len;
+	u16 n;
+
+	VRR_DBG("Packet type: VRR_AGGR");
+
+        eth_header_parse(skb, src_addr);
+
+	while (offset + sizeof(len) <= skb->len) {
+		skb_copy_bits(skb, offset, &len, sizeof(len));
+		offset += sizeof(len);
+		n = ntohs(len);
+		if (n < sizeof(struct vrr_data_header) || offset + n > skb->len) {
+			VRR_DBG("Invalid aggregated frame length: %x", n);
+			break;
+		}
+
+		frame = vrr_skb_alloc(ETH_HLEN + n, GFP_ATOMIC);
+		if (!frame)
+			break;
+		skb_reset_mac_header(frame);
+		memcpy(skb_put(frame, ETH_HLEN), skb_mac_header(skb), ETH_HLEN);
+		skb_pull(frame, ETH_HLEN);
+		skb_reset_network_header(frame);
+		skb_copy_bits(skb, offset, skb_put(frame, n), n);
+		offset += n;
+		frame->dev = skb->dev;
+		frame->protocol = skb->protocol;
+
+		/* Only data frames are aggregated, anything else in an
+		 * aggregate is dropped */
+		if (vrr_hdr(frame)->pkt_type != VRR_DATA &&
+		    vrr_hdr(frame)->pkt_type != VRR_DATA_FRAG) {
+			VRR_DBG("Aggregated pkt_type: %x",
+				vrr_hdr(frame)->pkt_type);
+			kfree_skb(frame);
+			continue;
+		}
+		vrr_rcv_frame(vrr, frame, src_addr);
+	}
+
+	kfree_skb(skb);
+	return 0;
+}
+
+int vrr_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt,
+	    struct net_device *orig_dev)
+{
+	struct vrr_node *vrr = vrr_get_node(dev_net(dev));
+	unsigned char src_addr[ETH_ALEN];
+
+        WARN_ATOMIC;
+
+	printk(KERN_ALERT "Received a VRR packet!");
+
+	/* VRR_INFO("vrr_version: %x", vh->vrr_version); */
+	/* VRR_INFO("pkt_type: %x", vh->pkt_type); */
+	/* VRR_INFO("protocol: %x", ntohs(vh->protocol)); */
+	/* VRR_INFO("data_len: %x", ntohs(vh->data_len)); */
+	/* VRR_INFO("hop_limit: %x", vh->hop_limit); */
+	/* VRR_INFO("h_csum: %x", vh->h_csum); */
+	/* VRR_INFO("src_id: %x", ntohl(vh->src_id)); */
+	/* VRR_INFO("dest_id: %x", ntohl(vh->dest_id)); */
+
+	/* Any frame from a neighbor shows it is alive, not just its
+	 * hellos */
+	reset_active_timeout(vrr);
+        eth_header_parse(skb, src_addr);
+        pset_reset_fail_count(vrr, src_addr);
+
+	return vrr_rcv_frame(vrr, skb, src_addr);
+}
+
+int vrr_local_rcv_setup(struct vrr_node *vrr, u32 dst, u32 pid, u32 proxy,
 			u32 vset_size, u32 *vset)
 {
-	u32 src = get_vrr_id();
+	u32 src = get_vrr_id(vrr);
 	u32 nh;
 
-	if (pset_get_status(dst) == PSET_UNKNOWN)
-		nh = rt_get_next(proxy);
+	if (pset_get_status(vrr, dst) == PSET_UNKNOWN)
+		nh = rt_get_next(vrr, proxy);
 	else
 		nh = dst;
 
-	if (!rt_add_route(src, dst, src, nh, pid)) {
+	if (!rt_add_route(vrr, src, dst, src, nh, pid)) {
 		/* TearDownPath(<pid, src>, null) */
-		tear_down_path(pid, src, null);
+		tear_down_path(vrr, pid, src, 0);
 		VRR_DBG("Couldn't add route. Should tear down path to %x", src);
 		return 0;
 	}
@@ -573,17 +1436,17 @@ int vrr_local_rcv_setup(u32 dst, u32 pid, u32 proxy,
 		VRR_DBG("Sending setup message: "
 			"src:%x dst:%x pid:%x proxy:%x vset_size:%x nh:%x",
 			src, dst, pid, proxy, vset_size, nh);
-		send_setup(src, dst, pid, proxy, vset_size, vset, nh);
+		send_setup(vrr, src, dst, pid, proxy, vset_size, vset, nh);
 		return 0;
 	}
 
 	return 0;
 }
 
-int vrr_local_rcv_setup_fail(u32 dst, u32 proxy, u32 vset_size,
-				u32 *vset)
+int vrr_local_rcv_setup_fail(struct vrr_node *vrr, u32 dst, u32 proxy,
+				u32 vset_size, u32 *vset)
 {
-	u32 src = get_vrr_id();
+	u32 src = get_vrr_id(vrr);
 	u32 nh;
         u32 ovset_size, *ovset;
 
@@ -592,19 +1455,19 @@ int vrr_local_rcv_setup_fail(u32 dst, u32 proxy, u32 vset_size,
 
 	VRR_DBG("Receiving setup fail from myself.");
 
-	if (pset_get_status(dst) == PSET_UNKNOWN)
-		nh = rt_get_next(proxy);
+	if (pset_get_status(vrr, dst) == PSET_UNKNOWN)
+		nh = rt_get_next(vrr, proxy);
 	else
 		nh = dst;
 
         ovset[0] = dst;
-	vrr_add(-1, ovset_size, ovset);
+	vrr_add(vrr, -1, ovset_size, ovset);
 
         if (nh) {
 		VRR_DBG("Sending setup_fail message: "
 			"src:%x dst:%x proxy:%x vset_size:%x nh:%x",
 			src, dst, proxy, vset_size, nh);
- 		send_setup_fail(src, dst, proxy, vset_size, vset, nh);
+ 		send_setup_fail(vrr, src, dst, proxy, vset_size, vset, nh);
 		return 0;
 	}
 
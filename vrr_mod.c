@@ -7,31 +7,52 @@
 #include <linux/err.h>
 #include <linux/errno.h>
 #include <net/sock.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #include <linux/jiffies.h>
 #include <linux/hardirq.h>
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 #include "vrr.h"
 #include "vrr_data.h"
 
-static void vrr_timer_tick(unsigned long arg);
-
 /* Defined in af_vrr.c */
 extern const struct net_proto_family vrr_family_ops;
 extern struct proto vrr_proto;
 
-static struct timer_list vrr_timer =
-		TIMER_INITIALIZER (vrr_timer_tick, 0, 0);
+static int vrr_net_id __read_mostly;
+
+/* Hellos, pset updates and repairs of every node run here, ahead of
+ * the ordinary system workqueue. */
+struct workqueue_struct *vrr_wq;
 
 static struct packet_type vrr_packet_type __read_mostly = {
 	.type = cpu_to_be16(ETH_P_VRR),
 	.func = vrr_rcv,
+	.gro_receive = vrr_gro_receive,
+	.gro_complete = vrr_gro_complete,
 };
 
+struct vrr_node *vrr_get_node(struct net *net)
+{
+	return net_generic(net, vrr_net_id);
+}
+
+/* sysfs is not namespace aware, so the attributes below show the
+ * node of the network namespace of the reading process. */
+static struct vrr_node *vrr_sysfs_node(void)
+{
+	return vrr_get_node(current->nsproxy->net_ns);
+}
+
 static ssize_t id_show(struct kobject *kobj, struct kobj_attribute *attr,
 			   char *buf)
 {
-	u_int value = get_vrr_id();
+	u_int value = get_vrr_id(vrr_sysfs_node());
 	return sprintf(buf, "%08x\n", value);
 }
 
@@ -39,21 +60,22 @@ static ssize_t pset_show_real(
 	struct kobject *kobj, 
 	struct kobj_attribute *attr,
 	char *buf,
-	u_int* (*get_pset_func)(void),
-	int (*get_pset_size_func)(void),
-	mac_addr* (*get_pset_mac_func)(void),
-	int (*get_pset_mac_size_func)(void))
+	u_int* (*get_pset_func)(struct vrr_node *),
+	int (*get_pset_size_func)(struct vrr_node *),
+	mac_addr* (*get_pset_mac_func)(struct vrr_node *),
+	int (*get_pset_mac_size_func)(struct vrr_node *))
 {
 	int i;
+	struct vrr_node *vrr = vrr_sysfs_node();
 
 	// VRR id in pset.
-	u_int *vrr_id = get_pset_func();
+	u_int *vrr_id = get_pset_func(vrr);
 
 	// Number of entries in pset.
-	int pset_len = get_pset_size_func()/sizeof(u32);
+	int pset_len = get_pset_size_func(vrr)/sizeof(u32);
 
 	// Mac address in pset.
-	mac_addr *mac = get_pset_mac_func();
+	mac_addr *mac = get_pset_mac_func(vrr);
 
 	// Max length of one line in the sysfs export.
 	//
@@ -69,7 +91,7 @@ static ssize_t pset_show_real(
 
 	// Check precondition: In the pset, there must be a one-to-one mapping
 	// between vrr id's and mac addresses.
-	if ((get_pset_mac_size_func()/sizeof(mac_addr)) != pset_len) 
+	if ((get_pset_mac_size_func(vrr)/sizeof(mac_addr)) != pset_len) 
 		goto exit;
 
 	// Build string to be exported to sysfs.
@@ -152,7 +174,7 @@ static ssize_t vset_show (struct kobject *kobj,
         // line_len = u32 + /n
 	int line_len = 9;
 
-	vset_size = vset_get_all(&vset);
+	vset_size = vset_get_all(vrr_sysfs_node(), &vset);
 
 	for (i = 0; i < vset_size; ++i) {
 		snprintf(buf + line_len * i,
@@ -165,6 +187,65 @@ static ssize_t vset_show (struct kobject *kobj,
 	return line_len * vset_size + 1;
 }
 
+static ssize_t ifaces_show(struct kobject *kobj, struct kobj_attribute *attr,
+			   char *buf)
+{
+	return vrr_dev_show_enabled(vrr_sysfs_node(), buf);
+}
+
+static ssize_t ifaces_store(struct kobject *kobj, struct kobj_attribute *attr,
+			    const char *buf, size_t count)
+{
+	int err = vrr_dev_set_enabled(vrr_sysfs_node(), buf);
+	return err ? err : count;
+}
+
+static ssize_t dev_list_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return vrr_dev_show_attached(vrr_sysfs_node(), buf);
+}
+
+static const char *vrr_stat_names[VRR_NSTATS] = {
+	"ctl_queued",
+	"ctl_done",
+	"ctl_backlog_drop",
+	"ctl_budget_out",
+	"ctl_throttle_neigh",
+	"ctl_throttle_type",
+	"dedup_hit",
+	"hop_expired",
+	"loop",
+	"setup_retry",
+	"setup_giveup",
+	"repair_splice",
+	"repair_fail",
+	"shortcut",
+	"txq_drop",
+	"aggr_sent",
+	"aggr_frames",
+	"frag_sent",
+	"reasm_ok",
+	"reasm_drop",
+	"label_hit",
+	"label_miss",
+};
+
+static ssize_t stats_show(struct kobject *kobj,
+			  struct kobj_attribute *attr, char *buf)
+{
+	struct vrr_node *vrr = vrr_sysfs_node();
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < VRR_NSTATS; i++)
+		len += sprintf(buf + len, "%s %d\n", vrr_stat_names[i],
+			       atomic_read(&vrr->stats[i]));
+	len += sprintf(buf + len, "ctl_backlog %d\n", vrr_ctl_backlog(vrr));
+
+	return len;
+}
+
 static struct kobj_attribute id_attr =
 	 __ATTR(id, 0666, id_show, NULL);
 static struct kobj_attribute pset_active_attr = 
@@ -175,6 +256,12 @@ static struct kobj_attribute pset_pending_attr =
 	__ATTR(pset_pending, 0666, pset_pending_show, NULL);
 static struct kobj_attribute vset_attr = 
 	__ATTR(vset, 0666, vset_show, NULL);
+static struct kobj_attribute ifaces_attr =
+	__ATTR(ifaces, 0644, ifaces_show, ifaces_store);
+static struct kobj_attribute dev_list_attr =
+	__ATTR(dev_list, 0444, dev_list_show, NULL);
+static struct kobj_attribute stats_attr =
+	__ATTR(stats, 0444, stats_show, NULL);
 
 static struct attribute *attrs[] = {
 	&id_attr.attr,
@@ -182,6 +269,9 @@ static struct attribute *attrs[] = {
 	&pset_not_active_attr.attr,
 	&pset_pending_attr.attr,
 	&vset_attr.attr,
+	&ifaces_attr.attr,
+	&dev_list_attr.attr,
+	&stats_attr.attr,
 	NULL,
 };
 
@@ -191,26 +281,155 @@ static struct attribute_group attr_group = {
 
 static struct kobject *vrr_obj;
 
+/* Arm the hello timer for the current interval, moved by up to
+ * VRR_HPKT_JITTER percent either way so that neighbors don't all
+ * broadcast at the same moment. */
+static void vrr_hello_arm(struct vrr_node *vrr)
+{
+	unsigned int delay = vrr->hello_delay;
+	unsigned int spread = delay * VRR_HPKT_JITTER / 100;
+
+	if (vrr->hello_stop)
+		return;
+
+	delay = delay - spread + net_random() % (2 * spread + 1);
+	hrtimer_start(&vrr->hello_timer,
+		      ktime_set(delay / 1000, (delay % 1000) * NSEC_PER_MSEC),
+		      HRTIMER_MODE_REL);
+}
+
+/* The pset or the active state changed. Go back to the shortest
+ * interval so that neighbors hear about it quickly; a node that is
+ * already fast keeps its timer so steady churn can't starve hellos. */
+void vrr_hello_fast(struct vrr_node *vrr)
+{
+	vrr->hello_changed = 1;
+	if (vrr->hello_delay == VRR_HPKT_MIN_DELAY)
+		return;
+
+	vrr->hello_delay = VRR_HPKT_MIN_DELAY;
+	vrr_hello_arm(vrr);
+}
+
 static void vrr_workqueue_handler(struct work_struct *work)
 {
-        detect_failures();
-        active_timeout();
-        send_hpkt();
+	struct vrr_node *vrr = container_of(work, struct vrr_node,
+					    hello_work);
+	int changed = xchg(&vrr->hello_changed, 0);
+
+        detect_failures(vrr);
+        vrr_bootstrap(vrr);
+        active_timeout(vrr);
+        vrr_send_hello(vrr, changed);
+
+	/* Back off while the neighborhood is stable */
+	if (!changed && !vrr->bootstrap)
+		vrr->hello_delay = min(2 * vrr->hello_delay,
+				       (unsigned int)VRR_HPKT_DELAY);
+	vrr_hello_arm(vrr);
 }
 
-static DECLARE_WORK(vrr_workqueue, vrr_workqueue_handler);
+/* This function runs in hard interrupt context. It can't run
+ * anything that sleeps. The work re-arms the timer when done. */
+static enum hrtimer_restart vrr_hello_tick(struct hrtimer *timer)
+{
+	struct vrr_node *vrr = container_of(timer, struct vrr_node,
+					    hello_timer);
+
+	queue_work(vrr_wq, &vrr->hello_work);
+	return HRTIMER_NORESTART;
+}
 
-/* This function runs with preemption (and possibly interrupts)
- * disabled. It can't run anything that sleeps. */
-static void vrr_timer_tick(unsigned long arg)
+/* Bring up the VRR node of a network namespace. Every namespace gets
+ * its own id, routing table, pset, vset, sockets and hello timer. */
+static int __net_init vrr_net_init(struct net *net)
 {
-	unsigned long tdelay;
+	struct vrr_node *vrr = vrr_get_node(net);
+	int err;
+
+	vrr->net = net;
+
+	err = vrr_node_init(vrr);
+	if (err)
+		return err;
+
+	err = pset_state_init(vrr);
+	if (err)
+		goto out_node;
+
+	err = vrr_data_init(vrr);
+	if (err)
+		goto out_node;
+
+	err = vrr_init_rcv(vrr);
+	if (err)
+		goto out_data;
 
-	tdelay = jiffies + (VRR_HPKT_DELAY * HZ / 1000);
-	schedule_work(&vrr_workqueue);
-	mod_timer(&vrr_timer, tdelay);
+	err = vrr_init_txq(vrr);
+	if (err)
+		goto out_rcv;
+
+	err = vrr_init_aggr(vrr);
+	if (err)
+		goto out_txq;
+	vrr_sock_init(vrr);
+
+	//start hello packet timer
+	INIT_WORK(&vrr->hello_work, vrr_workqueue_handler);
+	hrtimer_init(&vrr->hello_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	vrr->hello_timer.function = vrr_hello_tick;
+	vrr->hello_delay = VRR_HPKT_MIN_DELAY;
+	vrr->hello_changed = 0;
+	vrr->hello_stop = 0;
+	vrr->full_sent = jiffies;
+
+	/* First hello right away, the rest at the fast rate until
+	 * bootstrap is over */
+	queue_work(vrr_wq, &vrr->hello_work);
+
+	VRR_INFO("Node %08x up", vrr->id);
+	return 0;
+
+ out_txq:
+	vrr_exit_txq(vrr);
+ out_rcv:
+	vrr_exit_rcv(vrr);
+ out_data:
+	vrr_data_exit(vrr);
+ out_node:
+	vrr_node_exit(vrr);
+	return err;
 }
 
+static void __net_exit vrr_net_exit(struct net *net)
+{
+	struct vrr_node *vrr = vrr_get_node(net);
+
+	/* Nothing re-arms the timer once hello_stop is set. The hello
+	 * work may queue pset updates and repairs, so it goes first. */
+	vrr->hello_stop = 1;
+	hrtimer_cancel(&vrr->hello_timer);
+	cancel_work_sync(&vrr->hello_work);
+	hrtimer_cancel(&vrr->hello_timer);
+	vrr_exit_rcv(vrr);
+	cancel_work_sync(&vrr->fail_work);
+	vrr_repair_exit(vrr);
+	vrr_setup_exit(vrr);
+	vrr_exit_aggr(vrr);
+	vrr_exit_txq(vrr);
+	vrr_data_exit(vrr);
+	vrr_node_exit(vrr);
+
+	VRR_INFO("Node %08x down", vrr->id);
+}
+
+static struct pernet_operations vrr_net_ops = {
+	.init = vrr_net_init,
+	.exit = vrr_net_exit,
+	.id   = &vrr_net_id,
+	.size = sizeof(struct vrr_node),
+};
+
 //Initialize the module
 static int __init vrr_init(void)
 {
@@ -223,50 +442,65 @@ static int __init vrr_init(void)
 	   7. There is probably alot more than this */
 
 	int err;
-	unsigned long tdelay;
 
 	WARN_ATOMIC;
 
 	VRR_INFO("Begin init");
 
-	vrr_node_init();
-	vrr_data_init();
-	pset_state_init();
-	vrr_init_rcv();
-
-	err = proto_register(&vrr_proto, 1);
-	if (err) {
+	vrr_wq = create_rt_workqueue("vrr");
+	if (!vrr_wq) {
+		err = -ENOMEM;
 		goto out;
 	}
 
+	/* Starts the node of every namespace, so everything after it
+	 * must stop them again when it fails */
+	err = register_pernet_subsys(&vrr_net_ops);
+	if (err)
+		goto out_wq;
+
+	err = proto_register(&vrr_proto, 1);
+	if (err)
+		goto out_pernet;
+
 	/* Initialize routing/sysfs stuff here */
 	/* TODO: Split these into separate functions */
 	vrr_obj = kobject_create_and_add("vrr", kernel_kobj);
 	if (!vrr_obj) {
 		err = -ENOMEM;
-		goto out;
+		goto out_proto;
 	}
 
 	err = sysfs_create_group(vrr_obj, &attr_group);
-	if (err) {
-		kobject_put(vrr_obj);
-	}
+	if (err)
+		goto out_kobj;
 	/* --- */
 
 	/* Register our sockets protocol handler */
 	err = sock_register(&vrr_family_ops);
-	if (err) {
-		goto out;
-	}
+	if (err)
+		goto out_kobj;
 
-	dev_add_pack(&vrr_packet_type);
+	/* Attach interfaces, including the ones that already exist */
+	err = vrr_dev_init();
+	if (err)
+		goto out_sock;
 
-	//start hello packet timer
-	tdelay = jiffies + (VRR_HPKT_DELAY * HZ / 1000);
-	mod_timer(&vrr_timer, tdelay);
+	dev_add_pack(&vrr_packet_type);
 
 	VRR_INFO("End init");
+	return 0;
 
+ out_sock:
+	sock_unregister(AF_VRR);
+ out_kobj:
+	kobject_put(vrr_obj);
+ out_proto:
+	proto_unregister(&vrr_proto);
+ out_pernet:
+	unregister_pernet_subsys(&vrr_net_ops);
+ out_wq:
+	destroy_workqueue(vrr_wq);
  out:
 	return err;
 }
@@ -275,11 +509,13 @@ static void __exit vrr_exit(void)
 {
 	sock_unregister(AF_VRR);
 	dev_remove_pack(&vrr_packet_type);
-	del_timer(&vrr_timer);
+	vrr_dev_exit();
 	/* Cleanup routing/sysfs stuff here */
 	kobject_put(vrr_obj);
 
 	proto_unregister(&vrr_proto);
+	unregister_pernet_subsys(&vrr_net_ops);
+	destroy_workqueue(vrr_wq);
 }
 
 MODULE_AUTHOR("Team Alpaca");
@@ -3,92 +3,830 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/etherdevice.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
 #include "vrr.h"
 #include "vrr_data.h"
 
-int vrr_output(struct sk_buff *skb, struct vrr_node *vrr,
-	       int type)
+/* Pack small data frames for the same neighbor into one, see
+ * vrr_aggr_add() */
+static int aggr = 0;
+module_param(aggr, int, 0644);
+MODULE_PARM_DESC(aggr, "Aggregate small data frames per neighbor (0/1)");
+
+/* Queue unicast frames per neighbor and send them in deficit round
+ * robin order, see vrr_txq_handler() */
+static int txq;
+module_param(txq, int, 0644);
+MODULE_PARM_DESC(txq, "Schedule frames fairly across neighbors (0/1)");
+
+/* Send data frames too big for the link as one GSO frame and cut them
+ * into fragments only in vrr_xmit(), see vrr_gso_frame() */
+static int gso = 1;
+module_param(gso, int, 0644);
+MODULE_PARM_DESC(gso, "Fragment large data frames only on transmit (0/1)");
+
+/* Frames waiting for one neighbor */
+struct vrr_txq_neigh {
+	struct list_head list;		/* on the round robin list */
+	struct sk_buff_head q;
+	unsigned char mac[ETH_ALEN];
+	int ifindex;
+	int deficit;			/* bytes it may still send */
+	int active;
+};
+
+/* Small data frames waiting for one neighbor */
+struct vrr_aggr_neigh {
+	struct sk_buff_head q;
+	unsigned char mac[ETH_ALEN];
+	int len;			/* of the aggregate so far */
+	unsigned long deadline;		/* jiffies */
+};
+
+struct vrr_aggr {
+	spinlock_t lock;
+	struct vrr_aggr_neigh neigh[VRR_PSET_SIZE];
+	struct timer_list timer;
+	struct vrr_node *vrr;
+	int stop;
+};
+
+struct vrr_txq {
+	spinlock_t lock;
+	struct sk_buff_head ctl;	/* control frames, sent first */
+	struct vrr_txq_neigh neigh[VRR_PSET_SIZE];
+	struct list_head active;
+	int nactive;			/* neighbors on active */
+	unsigned long backoff;		/* jiffies, while all are stopped */
+	struct delayed_work work;
+	struct vrr_node *vrr;
+	int stop;
+};
+
+
+static int vrr_xmit_gso(struct sk_buff *skb, struct vrr_node *vrr);
+
+/* Hand skb to every usable interface, or only to the one the
+ * neighbor it is addressed to was heard on */
+static int vrr_xmit(struct sk_buff *skb, struct vrr_node *vrr)
 {
 	struct net_device *dev;
 	struct vrr_header *vh;
+	u8 *dest_mac;
 	struct sk_buff *clone;
 	struct list_head *pos;
 	struct vrr_interface_list *tmp;
+	struct sk_buff_head xmitq;
+	unsigned long flags;
+	int ifindex = 0, unicast, rc, busy, sent;
+
+	if (skb_is_gso(skb))
+		return vrr_xmit_gso(skb, vrr);
 
 	vh = (struct vrr_header *)skb->data;
 
+	dest_mac = vrr_next_mac(skb);
+
 	VRR_INFO("vrr_version: %x", vh->vrr_version);
 	VRR_INFO("pkt_type: %x", vh->pkt_type);
-	VRR_INFO("protocol: %x", ntohs(vh->protocol));
-	VRR_INFO("data_len: %x", ntohs(vh->data_len));
-	VRR_INFO("free: %x", vh->free);
-	VRR_INFO("h_csum: %x", vh->h_csum);
-	VRR_INFO("src_id: %x", ntohl(vh->src_id));
-	VRR_INFO("dest_id: %x", ntohl(vh->dest_id));
+	VRR_INFO("data_len: %x", vrr_hdr_data_len(vh));
+	VRR_INFO("hop_limit: %x", vrr_hdr_hops(vh));
+	VRR_INFO("src_id: %x", vrr_hdr_src(vh));
+	VRR_INFO("dest_id: %x", vrr_hdr_dst(vh));
 
+	/* Unicast frames only go out on the interface the neighbor
+	 * was heard on, when we know it. */
+	unicast = !is_multicast_ether_addr(dest_mac);
+	if (unicast)
+		ifindex = pset_get_ifindex(vrr, dest_mac);
+
+	/* Clone for every usable interface under the lock, holding
+	 * the device until the clone is handed to the driver. */
+	__skb_queue_head_init(&xmitq);
+	spin_lock_irqsave(&vrr->dev_lock, flags);
 	list_for_each(pos, &vrr->dev_list.list) {
 		tmp = list_entry(pos, struct vrr_interface_list, list);
-		dev = dev_get_by_name(&init_net, tmp->dev_name);
-		if (!dev)
+		if (!tmp->up || (ifindex && tmp->ifindex != ifindex))
 			continue;
 		clone = skb_clone(skb, GFP_ATOMIC);
 		if (clone) {
-			skb_reset_network_header(clone);
-			clone->dev = dev;
-			VRR_DBG("vh->dest_mac: %x:%x:%x:%x:%x:%x",
-				vh->dest_mac[0], 
-				vh->dest_mac[1],
-				vh->dest_mac[2], 
-				vh->dest_mac[3], 
-				vh->dest_mac[4], 
-				vh->dest_mac[5]);
-			dev_hard_header(clone, dev, ETH_P_VRR, vh->dest_mac,
-					dev->dev_addr, clone->len);
-                        VRR_DBG("Sending over iface %s", tmp->dev_name);
-			dev_queue_xmit(clone);
-			dev_put(dev);
+			dev_hold(tmp->dev);
+			clone->dev = tmp->dev;
+			clone->protocol = htons(ETH_P_VRR);
+			__skb_queue_tail(&xmitq, clone);
 		}
 	}
+	spin_unlock_irqrestore(&vrr->dev_lock, flags);
+
+	while ((clone = __skb_dequeue(&xmitq))) {
+		dev = clone->dev;
+		skb_reset_network_header(clone);
+		VRR_DBG("dest_mac: %x:%x:%x:%x:%x:%x",
+			dest_mac[0], 
+			dest_mac[1],
+			dest_mac[2], 
+			dest_mac[3], 
+			dest_mac[4], 
+			dest_mac[5]);
+		dev_hard_header(clone, dev, ETH_P_VRR, dest_mac,
+				dev->dev_addr, clone->len);
+                VRR_DBG("Sending over iface %s", dev->name);
+		busy = netif_queue_stopped(dev);
+		rc = dev_queue_xmit(clone);
+		dev_put(dev);
+
+		/* Repeated device errors towards a neighbor, such as a
+		 * dead device or no memory, mark it failed without
+		 * waiting for missed hellos. A stopped, congested or
+		 * full queue only adds to its load, which steers new
+		 * flows elsewhere. */
+		if (rc < 0)
+			sent = -1;
+		else
+			sent = rc == NET_XMIT_SUCCESS || rc == NET_XMIT_CN;
+		if (unicast && ifindex &&
+		    pset_tx_status(vrr, dest_mac, sent,
+				   busy || rc == NET_XMIT_CN ||
+				   rc == NET_XMIT_DROP))
+			vrr_schedule_repair(vrr);
+	}
 
 	kfree_skb(skb);
 	return NET_XMIT_SUCCESS;
 }
 
-/* Call the routing table to find next hop destination */
-int vrr_forward(struct sk_buff *skb, const struct vrr_header *vh)
+/* Must hold vrr->dev_lock */
+static int vrr_dev_stopped(struct vrr_node *vrr, int ifindex)
+{
+	struct vrr_interface_list *tmp;
+	struct list_head *pos;
+
+	list_for_each(pos, &vrr->dev_list.list) {
+		tmp = list_entry(pos, struct vrr_interface_list, list);
+		if (tmp->ifindex == ifindex)
+			return tmp->up && netif_queue_stopped(tmp->dev);
+	}
+	return 0;
+}
+
+/* Must hold txq->lock. The queue of the neighbor with mac, or a free
+ * one for it. Returns NULL when every queue is taken. */
+static struct vrr_txq_neigh *vrr_txq_find(struct vrr_txq *q, const u8 *mac)
+{
+	struct vrr_txq_neigh *free = NULL;
+	int i;
+
+	for (i = 0; i < VRR_PSET_SIZE; i++) {
+		if (!memcmp(q->neigh[i].mac, mac, ETH_ALEN))
+			return &q->neigh[i];
+		if (!free && !q->neigh[i].active)
+			free = &q->neigh[i];
+	}
+
+	if (free)
+		memcpy(free->mac, mac, ETH_ALEN);
+	return free;
+}
+
+/* Control frames go out before any data frame. Data frames are taken
+ * from the neighbor queues in deficit round robin order, VRR_TXQ_QUANTUM
+ * bytes per round, skipping neighbors whose interface queue is stopped
+ * so that they don't hold up the others. */
+static void vrr_txq_handler(struct work_struct *work)
+{
+	struct vrr_txq *q = container_of(work, struct vrr_txq, work.work);
+	struct vrr_node *vrr = q->vrr;
+	struct vrr_txq_neigh *n;
+	struct sk_buff *skb;
+	unsigned long flags, dflags;
+	int budget = VRR_TXQ_BUDGET, stalled = 0, stopped;
+
+	while (budget) {
+		spin_lock_irqsave(&q->lock, flags);
+		if ((skb = __skb_dequeue(&q->ctl)))
+			goto send;
+
+		if (!q->nactive || stalled >= q->nactive) {
+			spin_unlock_irqrestore(&q->lock, flags);
+			break;
+		}
+
+		n = list_first_entry(&q->active, struct vrr_txq_neigh, list);
+		skb = skb_peek(&n->q);
+		if (!skb) {
+			list_del(&n->list);
+			q->nactive--;
+			n->active = 0;
+			n->deficit = 0;
+			spin_unlock_irqrestore(&q->lock, flags);
+			continue;
+		}
+
+		spin_lock_irqsave(&vrr->dev_lock, dflags);
+		stopped = vrr_dev_stopped(vrr, n->ifindex);
+		spin_unlock_irqrestore(&vrr->dev_lock, dflags);
+		if (stopped) {
+			list_move_tail(&n->list, &q->active);
+			stalled++;
+			spin_unlock_irqrestore(&q->lock, flags);
+			continue;
+		}
+
+		if (n->deficit < skb->len) {
+			n->deficit += VRR_TXQ_QUANTUM;
+			list_move_tail(&n->list, &q->active);
+			spin_unlock_irqrestore(&q->lock, flags);
+			continue;
+		}
+
+		__skb_unlink(skb, &n->q);
+		n->deficit -= skb->len;
+		stalled = 0;
+send:
+		spin_unlock_irqrestore(&q->lock, flags);
+		vrr_xmit(skb, vrr);
+		budget--;
+	}
+
+	/* Out of budget, or every neighbor waits on a stopped queue. A
+	 * driver waking its queue doesn't tell us, so stopped queues are
+	 * polled again with exponential backoff while nothing goes out. */
+	spin_lock_irqsave(&q->lock, flags);
+	if (budget < VRR_TXQ_BUDGET)
+		q->backoff = 0;
+	if (!q->stop && (!skb_queue_empty(&q->ctl) || !list_empty(&q->active))) {
+		if (budget)
+			q->backoff = clamp(2 * q->backoff, 1UL,
+					   msecs_to_jiffies(VRR_TXQ_BACKOFF));
+		queue_delayed_work(vrr_wq, &q->work, budget ? q->backoff : 0);
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Queue skb for the scheduler. Returns -1 if it should be sent
+ * directly instead. */
+static int vrr_txq_enqueue(struct vrr_node *vrr, struct sk_buff *skb,
+			   int type)
+{
+	struct vrr_txq *q = vrr->txq;
+	u8 *dest_mac = vrr_next_mac(skb);
+	struct vrr_txq_neigh *n;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->stop) {
+		ret = -1;
+	} else if (type != VRR_DATA) {
+		if (skb_queue_len(&q->ctl) >= VRR_TXQ_CTL_DEPTH) {
+			VRR_INC_STAT(vrr, VRR_STAT_TXQ_DROP);
+			kfree_skb(skb);
+		} else {
+			__skb_queue_tail(&q->ctl, skb);
+		}
+	} else if (!(n = vrr_txq_find(q, dest_mac))) {
+		ret = -1;
+	} else if (skb_queue_len(&n->q) >= VRR_TXQ_DEPTH) {
+		VRR_INC_STAT(vrr, VRR_STAT_TXQ_DROP);
+		kfree_skb(skb);
+	} else {
+		if (!n->active) {
+			n->ifindex = pset_get_ifindex(vrr, dest_mac);
+			n->active = 1;
+			list_add_tail(&n->list, &q->active);
+			q->nactive++;
+		}
+		__skb_queue_tail(&n->q, skb);
+	}
+	if (!ret)
+		queue_delayed_work(vrr_wq, &q->work, 0);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return ret;
+}
+
+static int vrr_queue_xmit(struct sk_buff *skb, struct vrr_node *vrr,
+			  int type)
+{
+	if (txq && !is_multicast_ether_addr(vrr_next_mac(skb)) &&
+	    !vrr_txq_enqueue(vrr, skb, type))
+		return NET_XMIT_SUCCESS;
+
+	return vrr_xmit(skb, vrr);
+}
+
+int vrr_init_txq(struct vrr_node *vrr)
+{
+	struct vrr_txq *q;
+	int i;
+
+	q = kzalloc(sizeof(struct vrr_txq), GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+
+	spin_lock_init(&q->lock);
+	skb_queue_head_init(&q->ctl);
+	for (i = 0; i < VRR_PSET_SIZE; i++)
+		skb_queue_head_init(&q->neigh[i].q);
+	INIT_LIST_HEAD(&q->active);
+	INIT_DELAYED_WORK(&q->work, vrr_txq_handler);
+	q->vrr = vrr;
+
+	vrr->txq = q;
+	return 0;
+}
+
+void vrr_exit_txq(struct vrr_node *vrr)
+{
+	struct vrr_txq *q = vrr->txq;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->stop = 1;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	cancel_delayed_work_sync(&q->work);
+
+	skb_queue_purge(&q->ctl);
+	for (i = 0; i < VRR_PSET_SIZE; i++)
+		skb_queue_purge(&q->neigh[i].q);
+	kfree(q);
+	vrr->txq = NULL;
+}
+
+/* Spend a hop of a received frame about to be forwarded to nh_mac.
+ * Returns -1 if its hop limit ran out. A frame sent straight back to
+ * the neighbor it came from is counted as a loop. */
+static int vrr_forward_hop(struct vrr_node *vrr, struct sk_buff *skb,
+			   struct vrr_header *vh, const u8 *nh_mac)
+{
+	unsigned char prev[ETH_ALEN];
+	u8 hops = vrr_hdr_hops(vh) & VRR_HOP_MASK;
+
+	if (eth_header_parse(skb, prev) && !memcmp(prev, nh_mac, ETH_ALEN)) {
+		VRR_DBG("Frame for %x loops back to %x:%x:%x:%x:%x:%x",
+			vrr_hdr_dst(vh), prev[0], prev[1], prev[2],
+			prev[3], prev[4], prev[5]);
+		VRR_INC_STAT(vrr, VRR_STAT_LOOP);
+	}
+
+	if (vh->vrr_version < 2)
+		return 0;
+
+	if (hops <= 1) {
+		VRR_DBG("Hop limit reached for %x", vrr_hdr_dst(vh));
+		VRR_INC_STAT(vrr, VRR_STAT_HOP_EXPIRED);
+		return -1;
+	}
+
+	vrr_hdr_set_hops(vh, (vrr_hdr_hops(vh) & ~VRR_HOP_MASK) | (hops - 1));
+	return 0;
+}
+
+/* A destination that is our linked neighbor is sent to directly, and
+ * one linked to a neighbor of ours through the best such neighbor, as
+ * its last full hello showed. Anything else follows the routing table.
+ * The pset is only read from its lockless snapshot here. */
+u32 vrr_next_hop(struct vrr_node *vrr, u32 dest, u32 src, u32 *path_id)
 {
 	u32 nh;
+
+	*path_id = 0;
+	if (pset_link_weight(vrr, dest))
+		nh = dest;
+	else if (!pset_find_relay(vrr, dest, 0, &nh))
+		return rt_get_next_flow(vrr, dest, src, path_id);
+
+	/* Counted once per flow, not per frame */
+	if (rt_flow_note(vrr, dest, src, nh))
+		VRR_INC_STAT(vrr, VRR_STAT_SHORTCUT);
+	return nh;
+}
+
+/* Call the routing table to find next hop destination. A labelled
+ * frame follows its label while the route is still there; otherwise
+ * it is relabelled with the route it is sent on. */
+int vrr_forward(struct vrr_node *vrr, struct sk_buff *skb,
+		const struct vrr_header *vh)
+{
+	u32 nh = 0, dest = vrr_hdr_dst(vh), endpoint, path_id;
         u8 nh_mac[ETH_ALEN];
 	struct vrr_header *myvh;
 
-        nh = rt_get_next(ntohl(vh->dest_id));
-        if (!nh)
-		goto fail;
+	path_id = vrr_hdr_label(vh, &endpoint);
+	if (path_id)
+		nh = rt_get_next_label(vrr, endpoint, path_id);
 
-   	if (!pset_get_mac(nh, nh_mac))
+	if (nh) {
+		VRR_INC_STAT(vrr, VRR_STAT_LABEL_HIT);
+	} else {
+		if (path_id)
+			VRR_INC_STAT(vrr, VRR_STAT_LABEL_MISS);
+		nh = vrr_next_hop(vrr, dest, vrr_hdr_src(vh), &path_id);
+		if (!nh)
+			goto fail;
+		if (path_id && vh->vrr_version == VRR_VERSION_LABEL)
+			vrr_set_label(vrr, skb, dest, path_id);
+	}
+
+   	if (!pset_get_mac(vrr, nh, nh_mac))
 		goto fail;
 
 	myvh = (struct vrr_header *)skb_network_header(skb);
-        memcpy(myvh->dest_mac, nh_mac, MAC_ADDR_LEN);
-	return vrr_output(skb, vrr_get_node(), VRR_DATA);
+	if (vrr_forward_hop(vrr, skb, myvh, nh_mac)) {
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	skb->priority = vrr_tc_prio(vrr_tclass(myvh));
+	memset(skb->cb, 0, sizeof(skb->cb));
+	memcpy(vrr_next_mac(skb), nh_mac, ETH_ALEN);
+	return vrr_output(skb, vrr, VRR_DATA);
 
 fail:
 	return NET_XMIT_DROP;
 }
 
-int vrr_forward_setup_req(struct sk_buff *skb,
+int vrr_forward_setup_req(struct vrr_node *vrr, struct sk_buff *skb,
 			  const struct vrr_header *vh,
 			  u_int nh)
 {
 	unsigned char dest_mac[ETH_ALEN];
 	struct vrr_header *myvh;
 
-	if (!pset_get_mac(nh, dest_mac)) {
+	if (!pset_get_mac(vrr, nh, dest_mac)) {
 		VRR_ERR("Forwarding setup_req to unconnected node!");
 		return 0;
 	}
 
 	myvh = (struct vrr_header *)skb_network_header(skb);
+	if (vrr_forward_hop(vrr, skb, myvh, dest_mac)) {
+		kfree_skb(skb);
+		return 0;
+	}
+
         memcpy(myvh->dest_mac, dest_mac, ETH_ALEN);
-	return vrr_output(skb, vrr_get_node(), VRR_SETUP_REQ);
+	skb->priority = TC_PRIO_CONTROL;
+	return vrr_output(skb, vrr, VRR_SETUP_REQ);
+}
+
+/* Must hold aggr->lock. Take the frames waiting for n into one
+ * aggregate frame: <len, frame> * n, each len 16 bits. A single frame
+ * is sent as it is. */
+static struct sk_buff *vrr_aggr_take(struct vrr_node *vrr,
+				     struct vrr_aggr_neigh *n)
+{
+	struct sk_buff *skb, *agg;
+	struct vrr_packet pkt;
+	int count = skb_queue_len(&n->q);
+	__be16 len;
+
+	if (count <= 1) {
+		n->len = 0;
+		return __skb_dequeue(&n->q);
+	}
+
+	agg = vrr_skb_alloc(n->len, GFP_ATOMIC);
+	if (!agg) {
+		__skb_queue_purge(&n->q);
+		n->len = 0;
+		return NULL;
+	}
+
+	while ((skb = __skb_dequeue(&n->q))) {
+		len = htons(skb->len);
+		memcpy(skb_put(agg, sizeof(len)), &len, sizeof(len));
+		memcpy(skb_put(agg, skb->len), skb->data, skb->len);
+		kfree_skb(skb);
+	}
+
+	pkt.src = get_vrr_id(vrr);
+	pkt.dst = 0;
+	pkt.data_len = n->len;
+	pkt.pkt_type = VRR_AGGR;
+	memcpy(pkt.dest_mac, n->mac, ETH_ALEN);
+	build_header(vrr, agg, &pkt);
+	vrr_set_tclass(agg, VRR_TC_BE);
+
+	n->len = 0;
+	VRR_INC_STAT(vrr, VRR_STAT_AGGR_SENT);
+	return agg;
+}
+
+/* Send every aggregate whose time is up, or all of them */
+static void vrr_aggr_flush(struct vrr_aggr *a, int all)
+{
+	struct sk_buff_head out;
+	struct sk_buff *skb;
+	unsigned long flags, next = 0;
+	int i, pending = 0;
+
+	__skb_queue_head_init(&out);
+
+	spin_lock_irqsave(&a->lock, flags);
+	for (i = 0; i < VRR_PSET_SIZE; i++) {
+		if (skb_queue_empty(&a->neigh[i].q))
+			continue;
+		if (all || !time_before(jiffies, a->neigh[i].deadline)) {
+			if ((skb = vrr_aggr_take(a->vrr, &a->neigh[i])))
+				__skb_queue_tail(&out, skb);
+		} else if (!pending++ ||
+			   time_before(a->neigh[i].deadline, next)) {
+			next = a->neigh[i].deadline;
+		}
+	}
+	if (pending && !a->stop)
+		mod_timer(&a->timer, next);
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	while ((skb = __skb_dequeue(&out)))
+		vrr_queue_xmit(skb, a->vrr, VRR_DATA);
+}
+
+static void vrr_aggr_timer(unsigned long data)
+{
+	vrr_aggr_flush((struct vrr_aggr *)data, 0);
+}
+
+/* Hold a small data frame for up to VRR_AGGR_DELAY so that it can go
+ * out together with others for the same neighbor. A frame that can't
+ * be held first pushes out whatever waits for its neighbor, to keep
+ * frames in order. Returns -1 if skb is to be sent now. */
+static int vrr_aggr_add(struct vrr_node *vrr, struct sk_buff *skb)
+{
+	struct vrr_aggr *a = vrr->aggr;
+	struct vrr_header *vh = (struct vrr_header *)skb->data;
+	u8 *dest_mac = vrr_next_mac(skb);
+	struct vrr_aggr_neigh *n = NULL, *free = NULL;
+	struct sk_buff *out = NULL;
+	unsigned long flags;
+	int i, small, ret = 0;
+
+	small = aggr && !VRR_SKB_CB(skb)->noaggr &&
+		vrr_tclass(vh) != VRR_TC_INTERACTIVE &&
+		skb->len <= VRR_AGGR_SMALL;
+
+	spin_lock_irqsave(&a->lock, flags);
+	for (i = 0; i < VRR_PSET_SIZE; i++) {
+		if (skb_queue_empty(&a->neigh[i].q)) {
+			if (!free)
+				free = &a->neigh[i];
+		} else if (!memcmp(a->neigh[i].mac, dest_mac, ETH_ALEN)) {
+			n = &a->neigh[i];
+			break;
+		}
+	}
+
+	if (a->stop || !small || (!n && !free)) {
+		if (n)
+			out = vrr_aggr_take(vrr, n);
+		ret = -1;
+		goto out;
+	}
+
+	if (n && n->len + sizeof(__be16) + skb->len > VRR_AGGR_MAX(vrr->mtu))
+		out = vrr_aggr_take(vrr, n);
+
+	if (!n || !n->len) {
+		if (!n) {
+			n = free;
+			memcpy(n->mac, dest_mac, ETH_ALEN);
+		}
+		n->deadline = jiffies + msecs_to_jiffies(VRR_AGGR_DELAY);
+		if (!timer_pending(&a->timer) ||
+		    time_before(n->deadline, a->timer.expires))
+			mod_timer(&a->timer, n->deadline);
+	}
+	__skb_queue_tail(&n->q, skb);
+	n->len += sizeof(__be16) + skb->len;
+	VRR_INC_STAT(vrr, VRR_STAT_AGGR_FRAMES);
+out:
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	if (out)
+		vrr_queue_xmit(out, vrr, VRR_DATA);
+	return ret;
+}
+
+/* Build one VRR_DATA_FRAG frame carrying n bytes at fh->offset of the
+ * data of skb, which starts doff bytes past its VRR header */
+static struct sk_buff *vrr_frag_build(const struct sk_buff *skb,
+				      unsigned int doff,
+				      const struct vrr_frag_header *fh,
+				      unsigned int n)
+{
+	const unsigned int hlen = sizeof(struct vrr_header);
+	struct vrr_header *vh;
+	struct sk_buff *frag;
+
+	frag = vrr_skb_alloc(hlen + sizeof(*fh) + n, GFP_ATOMIC);
+	if (!frag)
+		return NULL;
+
+	skb_reset_network_header(frag);
+	vh = (struct vrr_header *)skb_put(frag, hlen);
+	skb_copy_bits(skb, 0, vh, hlen);
+	vh->pkt_type = VRR_DATA_FRAG;
+	vh->data_len = htons(sizeof(*fh) + n);
+	memcpy(skb_put(frag, sizeof(*fh)), fh, sizeof(*fh));
+	skb_copy_bits(skb, doff + ntohs(fh->offset), skb_put(frag, n), n);
+
+	frag->priority = skb->priority;
+	return frag;
+}
+
+/* Returns -1 if total bytes take more than VRR_FRAG_MAX fragments of
+ * chunk bytes */
+static int vrr_frag_init(struct vrr_node *vrr, struct vrr_frag_header *fh,
+			 unsigned int total, unsigned int chunk)
+{
+	if (DIV_ROUND_UP(total, chunk) > VRR_FRAG_MAX)
+		return -1;
+
+	fh->id = htonl(atomic_inc_return(&vrr->frag_id));
+	fh->total = htons(total);
+	fh->count = DIV_ROUND_UP(total, chunk);
+	fh->span = 1;
+	fh->reserved = 0;
+	return 0;
+}
+
+/* Split a data frame too big for the link into VRR_DATA_FRAG frames
+ * in software, when GSO is turned off. Fragments are forwarded as
+ * they are and only reassembled at the destination. */
+static int vrr_fragment(struct vrr_node *vrr, struct sk_buff *skb)
+{
+	const unsigned int hlen = sizeof(struct vrr_header);
+	const unsigned int chunk = VRR_FRAG_CHUNK(vrr->mtu);
+	unsigned int total = skb->len - hlen, offset, n;
+	struct vrr_frag_header fh;
+	struct sk_buff_head frags;
+	struct sk_buff *frag;
+	int i;
+
+	if (vrr_frag_init(vrr, &fh, total, chunk)) {
+		VRR_DBG("%u bytes take too many fragments", total);
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	/* Build every fragment before queuing any: a datagram missing
+	 * one could never be reassembled */
+	__skb_queue_head_init(&frags);
+	for (i = 0, offset = 0; i < fh.count; i++, offset += n) {
+		n = min(chunk, total - offset);
+		fh.offset = htons(offset);
+		fh.index = i;
+		frag = vrr_frag_build(skb, hlen, &fh, n);
+		if (!frag) {
+			__skb_queue_purge(&frags);
+			kfree_skb(skb);
+			return NET_XMIT_DROP;
+		}
+		__skb_queue_tail(&frags, frag);
+	}
+	kfree_skb(skb);
+
+	while ((frag = __skb_dequeue(&frags))) {
+		VRR_INC_STAT(vrr, VRR_STAT_FRAG_SENT);
+		vrr_queue_xmit(frag, vrr, VRR_DATA);
+	}
+	return NET_XMIT_SUCCESS;
+}
+
+/* Turn a data frame too big for the link into a single GSO frame: a
+ * VRR_DATA_FRAG header and fragment header spanning the whole
+ * datagram. It goes through the transmit queues once and is only cut
+ * into fragments by vrr_xmit_gso() on its way to the devices. */
+static int vrr_gso_frame(struct vrr_node *vrr, struct sk_buff *skb)
+{
+	const unsigned int hlen = sizeof(struct vrr_header);
+	const unsigned int chunk = VRR_FRAG_CHUNK(vrr->mtu);
+	unsigned int total = skb->len - hlen;
+	struct vrr_frag_header fh;
+	struct vrr_header *vh;
+
+	if (skb_cow_head(skb, sizeof(fh)) ||
+	    vrr_frag_init(vrr, &fh, total, chunk))
+		return vrr_fragment(vrr, skb);
+
+	fh.offset = 0;
+	fh.index = 0;
+	fh.span = fh.count;
+
+	vh = (struct vrr_header *)skb_push(skb, sizeof(fh));
+	memmove(vh, skb->data + sizeof(fh), hlen);
+	memcpy(skb->data + hlen, &fh, sizeof(fh));
+	vh->pkt_type = VRR_DATA_FRAG;
+	vh->data_len = htons(sizeof(fh) + total);
+	skb_reset_network_header(skb);
+
+	skb_shinfo(skb)->gso_size = chunk;
+	skb_shinfo(skb)->gso_segs = fh.count;
+
+	VRR_ADD_STAT(vrr, VRR_STAT_FRAG_SENT, fh.count);
+	return vrr_queue_xmit(skb, vrr, VRR_DATA);
+}
+
+/* Cut a frame from vrr_gso_frame() into fragments, once it is out of
+ * the transmit queues. No device segments VRR frames and the core's
+ * software GSO wants a checksum VRR doesn't have, so it is done here
+ * rather than registered with the packet type. */
+static int vrr_xmit_gso(struct sk_buff *skb, struct vrr_node *vrr)
+{
+	const unsigned int doff = sizeof(struct vrr_header) +
+		sizeof(struct vrr_frag_header);
+	const unsigned int chunk = skb_shinfo(skb)->gso_size;
+	struct sk_buff_head segs;
+	struct sk_buff *seg;
+	struct vrr_frag_header fh;
+	unsigned int total, offset, n;
+	int i;
+
+	if (skb_copy_bits(skb, sizeof(struct vrr_header), &fh, sizeof(fh)))
+		goto drop;
+	total = ntohs(fh.total);
+	fh.span = 1;
+
+	if (!chunk || DIV_ROUND_UP(total, chunk) != fh.count)
+		goto drop;
+
+	__skb_queue_head_init(&segs);
+	for (i = 0, offset = 0; i < fh.count; i++, offset += n) {
+		n = min(chunk, total - offset);
+		fh.offset = htons(offset);
+		fh.index = i;
+		seg = vrr_frag_build(skb, doff, &fh, n);
+		if (!seg) {
+			__skb_queue_purge(&segs);
+			goto drop;
+		}
+		__skb_queue_tail(&segs, seg);
+	}
+	kfree_skb(skb);
+
+	while ((seg = __skb_dequeue(&segs)))
+		vrr_xmit(seg, vrr);
+	return NET_XMIT_SUCCESS;
+
+drop:
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+
+int vrr_output(struct sk_buff *skb, struct vrr_node *vrr,
+	       int type)
+{
+	struct vrr_header *vh = (struct vrr_header *)skb->data;
+
+	/* Compact frames are only built when they fit */
+	if (vh->pkt_type == VRR_DATA && !vrr_hdr_compact(vh) &&
+	    skb->len > vrr->mtu)
+		return gso ? vrr_gso_frame(vrr, skb) : vrr_fragment(vrr, skb);
+
+	if (vh->pkt_type == VRR_DATA &&
+	    !is_multicast_ether_addr(vrr_next_mac(skb)) &&
+	    !vrr_aggr_add(vrr, skb))
+		return NET_XMIT_SUCCESS;
+
+	return vrr_queue_xmit(skb, vrr, type);
+}
+
+int vrr_init_aggr(struct vrr_node *vrr)
+{
+	struct vrr_aggr *a;
+	int i;
+
+	a = kzalloc(sizeof(struct vrr_aggr), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	spin_lock_init(&a->lock);
+	for (i = 0; i < VRR_PSET_SIZE; i++)
+		skb_queue_head_init(&a->neigh[i].q);
+	setup_timer(&a->timer, vrr_aggr_timer, (unsigned long)a);
+	a->vrr = vrr;
+
+	vrr->aggr = a;
+	return 0;
+}
+
+/* Whatever still waits goes out before the node goes away */
+void vrr_exit_aggr(struct vrr_node *vrr)
+{
+	struct vrr_aggr *a = vrr->aggr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&a->lock, flags);
+	a->stop = 1;
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	del_timer_sync(&a->timer);
+	vrr_aggr_flush(a, 1);
+	kfree(a);
+	vrr->aggr = NULL;
 }